@@ -11,6 +11,7 @@
 #include "user_input_manager.h"
 #include "reconstruction.h"
 #include "MJPEGWriter.h"
+#include "frame_prefetcher.h"
 
 struct WindowInputDataParams {
 public:
@@ -26,12 +27,12 @@ public:
 };
 
 struct AppSolverDataParams {
-    const std::string bUseMethod, ptCloudWinName, usrInpWinName, recPoseWinName, matchesWinName, bSource, fDecType, fMatchType, peMethod, pePMetrod, baMethod, tMethod;
-    const float bDownSamp, fKnnRatio, ofMaxItCt, ofItEps, ofMaxError, ofQualLvl, ofMinDist, peProb, peThresh, tMinDist, tMaxDist, tMaxPErr, cSRemThr, cLSize;
+    const std::string bUseMethod, ptCloudWinName, usrInpWinName, recPoseWinName, matchesWinName, bSource, fDecType, fMatchType, peMethod, pePMetrod, baMethod;
+    const float bDownSamp, fKnnRatio, ofMaxItCt, ofItEps, ofMaxError, ofQualLvl, ofMinDist, peProb, peThresh, peMinParal, peGuidRad, tMinDist, tMaxDist, tMaxPErr, cSRemThr, cLSize;
     const double baMaxRMSE, cSRange;
     const cv::Size winSize, camSize;
-    const bool peExGuess, bDebugVisE, bDebugMatE;
-    const int ofMinKPts, ofWinSize, ofMaxLevel, ofMaxCorn, peMinInl, peMinMatch, peNumIteR, bMaxSkFram, baProcIt, cFProcIt, peTMaxIter;
+    const bool peExGuess, peIdxMatch, baAsync, bDebugVisE, bDebugMatE, bHeadless;
+    const int fTileGrid, fTileKPts, ofMinKPts, ofWinSize, ofMaxLevel, ofMaxCorn, ofNumThr, ofGridSize, ofCellCorn, peMinInl, peMinMatch, peNumIteR, bMaxSkFram, bPrefetch, baProcIt, baWinSize, baFullIt, cFProcIt, peTMaxIter, peGuidIter, tMinViews;
     const cv::Mat cameraK, distCoeffs;
 
     /** 
@@ -48,11 +49,15 @@ struct AppSolverDataParams {
      * @param bSource source video file [.mp4, .avi ...]
      * @param bDownSamp downsampling of input source images
      * @param bMaxSkFram max number of skipped frames to swap
+     * @param bPrefetch number of images prepared ahead in background -> 0 loads synchronously
      * @param bDebugVisE ienable debug point cloud visualization by VTK, PCL
      * @param bDebugMatE enable debug matching visualization by GTK/...
+     * @param bHeadless disable all windows, debug drawing and MJPEG stream for batch processing
      * @param winSize debug windows size
      * @param camSize camera/image size
      * @param fDecType used detector type
+     * @param fTileGrid feature extraction tiles per image side processed in parallel, 0 or 1 extracts in whole image
+     * @param fTileKPts feature extraction max keypoints per tile, 0 keeps all
      * @param fMatchType used matcher type
      * @param fKnnRatio knn ration match
      * @param ofMinKPts optical flow min descriptor to generate new one
@@ -64,22 +69,32 @@ struct AppSolverDataParams {
      * @param ofMaxCorn optical flow max generated corners
      * @param ofQualLvl optical flow generated corners quality level
      * @param ofMinDist optical flow generated corners min distance
+     * @param ofNumThr optical flow number of point chunks tracked in parallel, 0 or 1 tracks on single thread
+     * @param ofGridSize optical flow corners replenishment grid cells per image side, 0 detects in whole image
+     * @param ofCellCorn optical flow max corners per grid cell
      * @param peMethod pose estimation fundamental matrix computation method [RANSAC/LMEDS]
      * @param peProb pose estimation confidence/probability
      * @param peThresh pose estimation threshold
+     * @param peMinParal pose estimation min median flow move in pixels to compute essential matrix, 0 disables the check
      * @param peMinInl pose estimation in number of homography inliers user for reconstruction
      * @param peMinMatch pose estimation min matches to break
      * @param pePMetrod pose estimation method SOLVEPNP_ITERATIVE/SOLVEPNP_P3P/SOLVEPNP_AP3P
      * @param peTMaxIter pose estimation max track iteration
+     * @param peGuidRad pose estimation guided matching search radius in pixels around projected cloud points, 0 disables guided matching
+     * @param peGuidIter pose estimation guided matching max PnP iteration
      * @param peExGuess pose estimation use extrinsic guess
+     * @param peIdxMatch pose estimation match against descriptor index of all track views, recent track views are matched on failure
      * @param peNumIteR pose estimation max iteration
      * @param baMethod bundle adjustment solver type DENSE_SCHUR/SPARSE_NORMAL_CHOLESKY
      * @param baMaxRMSE bundle adjustment max RMSE error to recover from back up
      * @param baProcIt bundle adjustment process each %d iteration
-     * @param tMethod triangulation method ITERATIVE/DLT
+     * @param baWinSize bundle adjustment local window of last cameras, 0 adjusts all cameras
+     * @param baFullIt bundle adjustment of all cameras process each %d iteration, 0 disables
+     * @param baAsync bundle adjustment runs in background thread and is merged in later iteration
      * @param tMinDist triangulation points min distance
      * @param tMaxDist triangulation points max distance
      * @param tMaxPErr triangulation points max reprojection error
+     * @param tMinViews triangulation min views to retriangulate cloud points before bundle adjustment, 0 disables retriangulation
      * @param cameraK camera intrics parameters
      * @param distCoeffs camera distortion parameters
      * @param cSRemThr statistical outlier removal stddev multiply threshold
@@ -87,8 +102,8 @@ struct AppSolverDataParams {
      * @param cSRange cloud radius search radius distance
      * @param cFProcIt cloud filter process each %d iteration
      */
-    AppSolverDataParams(const std::string bUseMethod, const std::string ptCloudWinName, const std::string usrInpWinName, std::string recPoseWinName, const std::string matchesWinName, const std::string bSource, const float bDownSamp, const int bMaxSkFram, const cv::Size winSize, const cv::Size camSize, const bool bDebugVisE, const bool bDebugMatE, const std::string fDecType, const std::string fMatchType, const float fKnnRatio, const int ofMinKPts, const int ofWinSize, const int ofMaxLevel, const float ofMaxItCt, const float ofItEps, const float ofMaxError, const int ofMaxCorn, const float ofQualLvl, const float ofMinDist, const std::string peMethod, const float peProb, const float peThresh, const int peMinInl, const int peMinMatch, const std::string pePMetrod, const bool peExGuess, const int peNumIteR, const int peTMaxIter, const std::string baMethod, const double baMaxRMSE, const int baProcIt, const std::string tMethod, const float tMinDist, const float tMaxDist, const float tMaxPErr, const cv::Mat cameraK, const cv::Mat distCoeffs, const float cSRemThr, const float cLSize, const double cSRange, const int cFProcIt) 
-        : bUseMethod(bUseMethod), ptCloudWinName(ptCloudWinName), usrInpWinName(usrInpWinName), recPoseWinName(recPoseWinName), matchesWinName(matchesWinName), bSource(bSource), bDownSamp(bDownSamp), bMaxSkFram(bMaxSkFram), winSize(winSize), camSize(camSize), bDebugVisE(bDebugVisE), bDebugMatE(bDebugMatE), fDecType(fDecType), fMatchType(fMatchType), fKnnRatio(fKnnRatio), ofMinKPts(ofMinKPts), ofWinSize(ofWinSize), ofMaxLevel(ofMaxLevel), ofMaxItCt(ofMaxItCt), ofItEps(ofItEps), ofMaxError(ofMaxError), ofMaxCorn(ofMaxCorn), ofQualLvl(ofQualLvl), ofMinDist(ofMinDist), peMethod(peMethod), peProb(peProb), peThresh(peThresh), peMinInl(peMinInl), peMinMatch(peMinMatch), pePMetrod(pePMetrod), peExGuess(peExGuess), peNumIteR(peNumIteR), peTMaxIter(peTMaxIter), baMethod(baMethod), baMaxRMSE(baMaxRMSE), baProcIt(baProcIt), tMethod(tMethod), tMinDist(tMinDist), tMaxDist(tMaxDist), tMaxPErr(tMaxPErr), cameraK(cameraK), distCoeffs(distCoeffs), cSRemThr(cSRemThr), cLSize(cLSize), cSRange(cSRange), cFProcIt(cFProcIt) {}
+    AppSolverDataParams(const std::string bUseMethod, const std::string ptCloudWinName, const std::string usrInpWinName, std::string recPoseWinName, const std::string matchesWinName, const std::string bSource, const float bDownSamp, const int bMaxSkFram, const int bPrefetch, const cv::Size winSize, const cv::Size camSize, const bool bDebugVisE, const bool bDebugMatE, const bool bHeadless, const std::string fDecType, const int fTileGrid, const int fTileKPts, const std::string fMatchType, const float fKnnRatio, const int ofMinKPts, const int ofWinSize, const int ofMaxLevel, const float ofMaxItCt, const float ofItEps, const float ofMaxError, const int ofMaxCorn, const float ofQualLvl, const float ofMinDist, const int ofNumThr, const int ofGridSize, const int ofCellCorn, const std::string peMethod, const float peProb, const float peThresh, const float peMinParal, const int peMinInl, const int peMinMatch, const std::string pePMetrod, const bool peExGuess, const bool peIdxMatch, const int peNumIteR, const int peTMaxIter, const float peGuidRad, const int peGuidIter, const std::string baMethod, const double baMaxRMSE, const int baProcIt, const int baWinSize, const int baFullIt, const bool baAsync, const float tMinDist, const float tMaxDist, const float tMaxPErr, const int tMinViews, const cv::Mat cameraK, const cv::Mat distCoeffs, const float cSRemThr, const float cLSize, const double cSRange, const int cFProcIt) 
+        : bUseMethod(bUseMethod), ptCloudWinName(ptCloudWinName), usrInpWinName(usrInpWinName), recPoseWinName(recPoseWinName), matchesWinName(matchesWinName), bSource(bSource), bDownSamp(bDownSamp), bMaxSkFram(bMaxSkFram), bPrefetch(bPrefetch), winSize(winSize), camSize(camSize), bDebugVisE(bDebugVisE), bDebugMatE(bDebugMatE), bHeadless(bHeadless), fDecType(fDecType), fTileGrid(fTileGrid), fTileKPts(fTileKPts), fMatchType(fMatchType), fKnnRatio(fKnnRatio), ofMinKPts(ofMinKPts), ofWinSize(ofWinSize), ofMaxLevel(ofMaxLevel), ofMaxItCt(ofMaxItCt), ofItEps(ofItEps), ofMaxError(ofMaxError), ofMaxCorn(ofMaxCorn), ofQualLvl(ofQualLvl), ofMinDist(ofMinDist), ofNumThr(ofNumThr), ofGridSize(ofGridSize), ofCellCorn(ofCellCorn), peMethod(peMethod), peProb(peProb), peThresh(peThresh), peMinParal(peMinParal), peMinInl(peMinInl), peMinMatch(peMinMatch), pePMetrod(pePMetrod), peExGuess(peExGuess), peIdxMatch(peIdxMatch), peNumIteR(peNumIteR), peTMaxIter(peTMaxIter), peGuidRad(peGuidRad), peGuidIter(peGuidIter), baMethod(baMethod), baMaxRMSE(baMaxRMSE), baProcIt(baProcIt), baWinSize(baWinSize), baFullIt(baFullIt), baAsync(baAsync), tMinDist(tMinDist), tMaxDist(tMaxDist), tMaxPErr(tMaxPErr), tMinViews(tMinViews), cameraK(cameraK), distCoeffs(distCoeffs), cSRemThr(cSRemThr), cLSize(cLSize), cSRange(cSRange), cFProcIt(cFProcIt) {}
 };
 
 class AppSolver {
@@ -105,24 +120,27 @@ private:
 
     bool m_isUpdating;
 
+    // candidate images, buffers are exchanged with ViewDataContainer slots
+    ViewData m_nextView;
+
     /** 
      * Find good images
      * 
      * The result will be added to ViewDataContainer
      */
-    int findGoodImages(cv::VideoCapture cap, ViewDataContainer& viewContainer);
+    int findGoodImages(FramePrefetcher& frameLoader, ViewDataContainer& viewContainer);
 
     /** 
      * Find good images by optical flow
      * 
      * The result will be added to ViewDataContainer
      */
-    int findGoodImages(cv::VideoCapture& cap, ViewDataContainer& viewContainer, FeatureDetector featDetector, OptFlow optFlow, CameraParameters camera, RecoveryPose& recPose, FlowView& ofPrevView, FlowView& ofCurrView);
+    int findGoodImages(FramePrefetcher& frameLoader, ViewDataContainer& viewContainer, FeatureDetector featDetector, OptFlow optFlow, CameraParameters camera, RecoveryPose& recPose, FlowView& ofPrevView, FlowView& ofCurrView);
 
     /** 
-     * Load and convert image to grayscale
+     * Load prepared image and its grayscale from prefetcher
      */
-    int prepareImage(cv::VideoCapture& cap, cv::Mat& imColor, cv::Mat& imGray);
+    int prepareImage(FramePrefetcher& frameLoader, ViewData& view);
 
     /**
      * Handle user input
@@ -66,6 +66,29 @@ public:
 
         numCameras++;
     }
+
+    /** 
+     * Predict next camera pose by constant velocity model
+     * Motion between two last poses is applied to the last pose
+     * 
+     * @return false if there are less than two poses
+     */
+    bool predictCamPose(cv::Matx34d& pose) const {
+        if (extrinsics.size() < 2) { return false; }
+
+        cv::Matx33d _prevR, _lastR; cv::Matx31d _prevT, _lastT;
+
+        decomposeExtrinsicMat(*std::next(extrinsics.rbegin()), _prevR, _prevT);
+        decomposeExtrinsicMat(extrinsics.back(), _lastR, _lastT);
+
+        // relative motion from previous to last camera
+        const cv::Matx33d _motionR = _lastR * _prevR.t();
+        const cv::Matx31d _motionT = _lastT - _motionR * _prevT;
+
+        composeExtrinsicMat(_motionR * _lastR, _motionR * _lastT + _motionT, pose);
+
+        return true;
+    }
 };
 
 #endif //CAMERA_H
\ No newline at end of file
@@ -41,37 +41,54 @@ inline void decomposeExtrinsicMat(cv::Matx34d pose, cv::Matx33d& R, cv::Vec3d& t
 }
 
 /** 
- *  Convert points to mat
- *  Usually for data preparation for OpenCV SFM structure
+ * Growable array of fixed size chunks
+ * 
+ * Chunks are never reallocated -> element addresses stay valid while array grows
+ * Elements are accessed by stable integer index
  */
-inline void pointsToMat(std::vector<cv::Point2f> points, cv::Mat& pointsMat) {
-    pointsMat = (cv::Mat_<double>(2,1) << 1, 1);;
+template <typename T, size_t ChunkBits = 12>
+class ChunkedArray {
+private:
+    static constexpr size_t CHUNK_SIZE = (size_t)1 << ChunkBits;
 
-    for (const auto& p : points) {
-        cv::Mat _pointMat = (cv::Mat_<double>(2,1) << p.x, p.y);
+    std::vector<std::unique_ptr<T[]>> m_chunks;
 
-        cv::hconcat(pointsMat, _pointMat, pointsMat);
-    } 
+    size_t m_size;
+public:
+    ChunkedArray() 
+        : m_size(0) {}
 
-    pointsMat = pointsMat.colRange(1, pointsMat.cols);
-}
+    void push_back(const T& value) {
+        if ((m_size >> ChunkBits) == m_chunks.size())
+            m_chunks.emplace_back(new T[CHUNK_SIZE]);
 
-/** 
- * Convert points to mat
- * Usually for data preparation for OpenCV SFM structure
- */
-inline void pointsToMat(cv::Mat points, cv::Mat& pointsMat) {
-    pointsMat = (cv::Mat_<double>(2,1) << 1, 1);;
+        m_chunks[m_size >> ChunkBits][m_size & (CHUNK_SIZE - 1)] = value;
 
-    for (size_t i = 0; i < points.cols; ++i) {
-        cv::Point2f _point = points.at<cv::Point2f>(i);
+        m_size++;
+    }
 
-        cv::Mat _pointMat = (cv::Mat_<double>(2,1) << _point.x, _point.y);
+    T& operator[](const size_t idx) { return m_chunks[idx >> ChunkBits][idx & (CHUNK_SIZE - 1)]; }
 
-        cv::hconcat(pointsMat, _pointMat, pointsMat);
-    } 
+    const T& operator[](const size_t idx) const { return m_chunks[idx >> ChunkBits][idx & (CHUNK_SIZE - 1)]; }
 
-    pointsMat = pointsMat.colRange(1, pointsMat.cols);
-}
+    size_t size() const { return m_size; }
+
+    bool empty() const { return m_size == 0; }
+
+    /** 
+     * Copy elements to contiguous vector
+     */
+    void copyTo(std::vector<T>& values) const {
+        values.resize(m_size);
+
+        for (size_t c = 0, i = 0; i < m_size; ++c) {
+            const size_t _num = std::min(CHUNK_SIZE, m_size - i);
+
+            std::copy(m_chunks[c].get(), m_chunks[c].get() + _num, values.begin() + i);
+
+            i += _num;
+        }
+    }
+};
 
 #endif //COMMON_H
\ No newline at end of file
@@ -0,0 +1,80 @@
+#ifndef DESCRIPTOR_INDEX_H
+#define DESCRIPTOR_INDEX_H
+#pragma once
+
+#include "pch.h"
+#include "feature_processing.h"
+
+#include <opencv4/opencv2/flann.hpp>
+
+/**
+ * DescriptorIndex over descriptors of all TrackViews
+ *
+ * It grows with every registered track and maps each descriptor to its cloud point
+ * Binary descriptors are indexed by multi-probe LSH, float descriptors by KD forest
+ */
+class DescriptorIndex {
+private:
+    // LSH -> number of hash tables and sampled bits per table
+    static constexpr int LSH_NUM_TABLES = 6, LSH_KEY_SIZE = 14;
+
+    // KD forest -> number of trees, checks and neighbours per query
+    static constexpr int KD_NUM_TREES = 4, KD_NUM_CHECKS = 32, KD_NUM_NEIGHBOURS = 8;
+
+    // KD forest is rebuilt when not indexed tail is as big as indexed part
+    static constexpr int KD_MIN_BUILD_ROWS = 256;
+
+    int m_descType, m_descCols;
+
+    // binary descriptors are stored padded for HammingKnnMatcher::distance
+    cv::Mat m_descriptors;
+
+    // cloud point idx for each stored descriptor
+    std::vector<size_t> m_cloudIdxs;
+
+    // LSH sampled bit positions and buckets of descriptor rows for each table
+    std::vector<std::vector<int>> m_lshBits;
+    std::vector<std::vector<std::vector<int>>> m_lshBuckets;
+
+    // KD forest over the first indexed rows -> data copy is kept alive for FLANN
+    std::unique_ptr<cv::flann::Index> m_kdIndex;
+    cv::Mat m_kdData;
+    int m_numKdIndexed;
+
+    uint lshKey(const uchar* desc, const int table) const;
+
+    void addLSH(const int firstRow);
+
+    void updateKdIndex();
+
+    /**
+     * Collect candidate rows by probing query bucket and all buckets in one bit distance
+     */
+    void findLSHCandidates(const uchar* desc, std::vector<int>& candidates) const;
+public:
+    DescriptorIndex()
+        : m_descType(-1), m_descCols(0), m_numKdIndexed(0) {}
+
+    /**
+     * Append descriptors with their cloud point idxs
+     */
+    void add(const cv::Mat& descriptor, const std::vector<size_t>& cloudIdxs);
+
+    /**
+     * Match query descriptors against the whole index
+     *
+     * Ratio test compares the best and the second best distinct cloud point
+     * Each cloud point is assigned only to its best query descriptor
+     *
+     * @param matches queryIdx is query row, trainIdx is index row -> use getCloudIdx
+     */
+    void match(const cv::Mat& queryDesc, const float ratioThreshold, std::vector<cv::DMatch>& matches);
+
+    size_t getCloudIdx(const int row) const { return m_cloudIdxs[row]; }
+
+    size_t size() const { return m_cloudIdxs.size(); }
+
+    bool empty() const { return m_cloudIdxs.empty(); }
+};
+
+#endif //DESCRIPTOR_INDEX_H
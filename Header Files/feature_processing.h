@@ -9,16 +9,43 @@ class FeatureDetector {
 private:
     enum DetectorType { AKAZE = 0, ORB, FAST, STAR, SIFT, SURF, KAZE, BRISK };
 
+    // tiles overlap by descriptor support radius
+    static constexpr int TILE_OVERLAP = 32;
+
     DetectorType m_detectorType;
+
+    const int m_tileGrid, m_tileMaxKeyPts;
+
+    std::vector<cv::Ptr<cv::FeatureDetector>> m_tileDetectors, m_tileExtractors;
+
+    static void createDetector(DetectorType detectorType, cv::Ptr<cv::FeatureDetector>& detector, cv::Ptr<cv::FeatureDetector>& extractor);
+
+    /** 
+     *  Generate features in overlapping tiles in parallel
+     */
+    void generateTileFeatures(cv::Mat& imGray, std::vector<cv::KeyPoint>& keyPts, cv::Mat& descriptor);
+
+    /** 
+     *  Replenish flow features only in grid cells with few live corners
+     */
+    void generateGridFlowFeatures(cv::Mat& imGray, std::vector<cv::Point2f>& corners, int maxCorners, double qualityLevel, double minDistance, int gridSize, int cellMaxCorners);
 public:
     cv::Ptr<cv::FeatureDetector> detector, extractor;
 
-    FeatureDetector(std::string method);
+    /** 
+     *  FeatureDetector constructor
+     * 
+     *  @param method detector type
+     *  @param tileGrid tiles per image side for parallel extraction, 0 or 1 extracts in whole image
+     *  @param tileMaxKeyPts max keypoints per tile, 0 keeps all
+     */
+    FeatureDetector(std::string method, const int tileGrid = 0, const int tileMaxKeyPts = 0);
 
     /** 
      *  Generate features for triangulation
      * 
      *  It uses AKAZE, FAST, STAR, SIFT, SURF, KAZE, BRISK detector
+     *  If tileGrid > 1, tiles are extracted in parallel and merged in tile order
      */
     void generateFeatures(cv::Mat& imGray, std::vector<cv::KeyPoint>& keyPts, cv::Mat& descriptor);
 
@@ -26,13 +53,75 @@ public:
      *  Generate features for flow tracking
      * 
      *  It uses Shi-Tomasi corner detector
+     *  If gridSize > 0, detection runs only in grid cells with less than cellMaxCorners live corners
+     */
+    void generateFlowFeatures(cv::Mat& imGray, std::vector<cv::Point2f>& corners, int maxCorners, double qualityLevel, double minDistance, int gridSize = 0, int cellMaxCorners = 0);
+};
+
+/** 
+ * Brute force Hamming matcher for binary descriptors
+ * 
+ * Best and second best neighbours are found in both directions from one pass over distance tiles
+ * Distance is computed by popcount, by AVX2 kernel if the CPU supports it
+ */
+class HammingKnnMatcher {
+public:
+    struct KnnPair {
+        int bestDist, secondDist, bestIdx;
+
+        KnnPair() 
+            : bestDist(INT_MAX), secondDist(INT_MAX), bestIdx(-1) {}
+
+        void update(const int dist, const int idx) {
+            // strict comparison -> lower index wins on equal distance
+            if (dist < bestDist) {
+                secondDist = bestDist;
+                bestDist = dist;
+                bestIdx = idx;
+            } else if (dist < secondDist)
+                secondDist = dist;
+        }
+
+        void merge(const KnnPair& other) {
+            update(other.bestDist, other.bestIdx);
+            update(other.secondDist, -1);
+        }
+    };
+
+    // descriptors are padded to the whole blocks -> padding zeros do not change distance
+    static constexpr int BLOCK_BYTES = 32;
+
+    /** 
+     * Distance of single descriptor pair
+     */
+    static int distance(const uchar* a, const uchar* b, const int numBytes);
+
+    /** 
+     * Distances of one descriptor to block of rows -> kernel setup is shared by the whole block
+     */
+    static void distances(const uchar* a, const uchar* const* rows, const int numRows, const int numBytes, int* dists);
+
+    /** 
+     * Copy descriptors to zero padded rows of the whole blocks
+     */
+    static void padRows(const cv::Mat& desc, cv::Mat& paddedDesc);
+
+    /** 
+     * Find two nearest neighbours for each left row in right descriptors and vice versa
      */
-    void generateFlowFeatures(cv::Mat& imGray, std::vector<cv::Point2f>& corners, int maxCorners, double qualityLevel, double minDistance);
+    static void knnMatch(const cv::Mat& lDesc, const cv::Mat& rDesc, std::vector<KnnPair>& lKnn, std::vector<KnnPair>& rKnn);
 };
 
 class DescriptorMatcher {
 private:
-    void drawMatches(const cv::Mat prevFrame, const cv::Mat currFrame, cv::Mat& outFrame, std::vector<cv::KeyPoint> prevKeyPts, std::vector<cv::KeyPoint> currKeyPts, std::vector<cv::DMatch> matches, const std::string matchType);
+    bool m_useHammingKernel;
+
+    /** 
+     * Knn ratio match in both directions by HammingKnnMatcher
+     */
+    void hammingRatioMatches(const cv::Mat& lDesc, const cv::Mat& rDesc, std::vector<cv::DMatch>& lMatches, std::vector<cv::DMatch>& rMatches);
+
+    void drawMatches(const cv::Mat prevFrame, const cv::Mat currFrame, cv::Mat& outFrame, const std::vector<cv::KeyPoint>& prevKeyPts, const std::vector<cv::KeyPoint>& currKeyPts, const std::vector<cv::DMatch>& matches, const std::string matchType);
 
 public:
     const bool m_isVisDebug;
@@ -53,13 +142,131 @@ public:
     /** 
      * Robust matching by knn match, crossmatching, epipolar filter
      */
-    void findRobustMatches(std::vector<cv::KeyPoint> prevKeyPts, std::vector<cv::KeyPoint> currKeyPts, cv::Mat prevDesc, cv::Mat currAligPts, std::vector<cv::Point2f>& prevAligPts, std::vector<cv::Point2f>& currPts, std::vector<cv::DMatch>& matches, std::vector<int>& prevPtsToKeyIdx, std::vector<int>& currPtsToKeyIdx, cv::Mat debugPrevFrame, cv::Mat debugCurrFrame, bool useEpipolarFilter);
+    void findRobustMatches(const std::vector<cv::KeyPoint>& prevKeyPts, const std::vector<cv::KeyPoint>& currKeyPts, const cv::Mat& prevDesc, const cv::Mat& currDesc, std::vector<cv::Point2f>& prevAligPts, std::vector<cv::Point2f>& currAligPts, std::vector<cv::DMatch>& matches, std::vector<int>& prevPtsToKeyIdx, std::vector<int>& currPtsToKeyIdx, cv::Mat debugPrevFrame, cv::Mat debugCurrFrame, bool useEpipolarFilter);
+};
+
+/** 
+ * FlowTracks to store tracked points as structure of arrays
+ * 
+ * Previous/current positions, status, error and ids are kept aligned
+ * Filters compact all arrays in single pass
+ */
+class FlowTracks {
+private:
+    template <typename T>
+    static void compactArray(std::vector<T>& arr, const std::vector<uchar>& keepMask, const size_t numTracks) {
+        // optional arrays are not filled yet
+        if (arr.size() != numTracks) { return; }
+
+        size_t newIdx = 0;
+
+        for (size_t idx = 0; idx < numTracks; ++idx) {
+            if (!keepMask[idx]) { continue; }
+
+            if (newIdx != idx) 
+                arr[newIdx] = arr[idx];
+
+            newIdx++;
+        }
+
+        arr.resize(newIdx);
+    }
+
+    // filter mask buffer -> reused by every compaction
+    std::vector<uchar> m_keepMask;
+public:
+    std::vector<cv::Point2f> prevPts, currPts;
+
+    std::vector<uchar> statusMask;
+
+    std::vector<float> error;
+
+    // corners are numbered from zero, other points are distinguished by id offset
+    std::vector<size_t> ids;
+
+    size_t size() const { return prevPts.size(); }
+
+    bool empty() const { return prevPts.empty(); }
+
+    /** 
+     * Set previous positions of corners, other arrays are cleared
+     * Buffers are reused
+     */
+    void setPoints(const std::vector<cv::Point2f>& prevPts) {
+        this->prevPts.assign(prevPts.begin(), prevPts.end());
+
+        currPts.clear();
+        statusMask.clear();
+        error.clear();
+        ids.resize(prevPts.size());
+
+        for (size_t idx = 0; idx < ids.size(); ++idx)
+            ids[idx] = idx;
+    }
+
+    /** 
+     * Append previous positions of points with ids starting by idOffset
+     */
+    void addPoints(const std::vector<cv::Point2f>& prevPts, const size_t idOffset) {
+        const size_t numTracks = size();
+
+        this->prevPts.insert(this->prevPts.end(), prevPts.begin(), prevPts.end());
+
+        ids.resize(this->prevPts.size());
+
+        for (size_t idx = numTracks; idx < ids.size(); ++idx)
+            ids[idx] = idOffset + (idx - numTracks);
+    }
+
+    /** 
+     * Move positions out of tracks without copying
+     */
+    void releasePoints(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts) {
+        std::swap(this->prevPts, prevPts);
+        std::swap(this->currPts, currPts);
+    }
+
+    /** 
+     * Get cleared keep mask buffer for all tracks to fill it by filter
+     */
+    std::vector<uchar>& getKeepMask() {
+        m_keepMask.assign(size(), 0);
+
+        return m_keepMask;
+    }
+
+    /** 
+     * Keep only tracks with nonzero keepMask, relative order is preserved
+     * 
+     * @param idxMap optional mapping from old index to new index, -1 for removed track
+     * @return number of kept tracks
+     */
+    size_t compact(const std::vector<uchar>& keepMask, std::vector<int>* idxMap = NULL) {
+        const size_t numTracks = size();
+
+        if (idxMap != NULL) {
+            idxMap->resize(numTracks);
+
+            for (size_t idx = 0, newIdx = 0; idx < numTracks; ++idx)
+                (*idxMap)[idx] = keepMask[idx] ? (int)newIdx++ : -1;
+        }
+
+        compactArray(prevPts, keepMask, numTracks);
+        compactArray(currPts, keepMask, numTracks);
+        compactArray(error, keepMask, numTracks);
+        compactArray(ids, keepMask, numTracks);
+
+        // mask may be the status mask -> compact it last, in place compaction reads only items not written yet
+        compactArray(statusMask, keepMask, numTracks);
+
+        return size();
+    }
 };
 
 class OptFlowAddSettings {
 public:
     float maxError, qualLvl, minDist;
-    uint maxCorn, minFeatures;
+    uint maxCorn, minFeatures, numThreads, gridSize, cellMaxCorn;
 
     void setMaxError(float maxError) { this->maxError = maxError; }
 
@@ -70,19 +277,31 @@ public:
     void setMinDistance(float minDist) { this->minDist = minDist; }
 
     void setMinFeatures(uint minFeatures) { this->minFeatures = minFeatures; }
+
+    void setNumThreads(uint numThreads) { this->numThreads = numThreads; }
+
+    void setGridSize(uint gridSize) { this->gridSize = gridSize; }
+
+    void setCellMaxCorners(uint cellMaxCorn) { this->cellMaxCorn = cellMaxCorn; }
 };
 
 class OptFlow {
 private:
     void correctComputedPoints(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts);
+
+    void filterByError(FlowTracks& tracks);
+
+    /** 
+     *  Track point chunks concurrently over shared pyramids
+     *  Each point is tracked independently -> same result as single calc call
+     */
+    void computeFlowParallel(const std::vector<cv::Mat>& prevPyr, const std::vector<cv::Mat>& currPyr, FlowTracks& tracks);
 public:
     cv::Ptr<cv::SparsePyrLKOpticalFlow> optFlow;
 
     OptFlowAddSettings additionalSettings;
 
-    std::vector<uchar> statusMask;
-
-    OptFlow(cv::TermCriteria termcrit, int winSize, int maxLevel, float maxError, uint maxCorners, float qualityLevel, float minCornersDistance, uint minFeatures);
+    OptFlow(cv::TermCriteria termcrit, int winSize, int maxLevel, float maxError, uint maxCorners, float qualityLevel, float minCornersDistance, uint minFeatures, uint numThreads = 1, uint gridSize = 0, uint cellMaxCorners = 0);
 
     /** 
      *  Compute optical flow between grayscale images
@@ -92,9 +311,14 @@ public:
      *  @param useErrorCorrection filter by optical flow error
      *  @param useOutliersCorrection filter by outliers
      */
-    void computeFlow(cv::Mat imPrevGray, cv::Mat imCurrGray, std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, std::vector<uchar>& statusMask);
+    void computeFlow(cv::Mat imPrevGray, cv::Mat imCurrGray, FlowTracks& tracks);
 
-    void filterPoints(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, std::vector<uchar>& statusMask, cv::Rect boundary, bool useBoundaryCorrection, bool useErrorCorrection);
+    /** 
+     *  Compute optical flow between views
+     *  It uses cached view pyramids -> each pyramid is built only once
+     *  Points are split to chunks and tracked in parallel if numThreads > 1
+     */
+    void computeFlow(ViewData* prevView, ViewData* currView, FlowTracks& tracks);
 
     void drawOpticalFlow(cv::Mat inputImg, cv::Mat& outputImg, const std::vector<cv::Point2f> prevPts, const std::vector<cv::Point2f> currPts, std::vector<uchar> statusMask);
 };
@@ -122,10 +346,11 @@ public:
 };
 
 struct PointsMove {
-    float Q1, Q2, Q3;
+    // zero move, if there are not enough points to analyze
+    float Q1 = 0.0f, Q2 = 0.0f, Q3 = 0.0f;
 
-    float lowerInFence, upperInFence;
-    float lowerOutFence, upperOutFence;
+    float lowerInFence = 0.0f, upperInFence = 0.0f;
+    float lowerOutFence = 0.0f, upperOutFence = 0.0f;
 
     cv::Point2f medianMove;
 };
@@ -136,9 +361,15 @@ public:
 
     static void filterPointsByStatusMask(std::vector<cv::Point2f>& points, const std::vector<uchar>& statusMask);
 
-    static void filterPointsByBoundary(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, const cv::Rect boundary);
+    /** 
+     * Remove tracks with current position outside of boundary
+     */
+    static void filterPointsByBoundary(FlowTracks& tracks, const cv::Rect boundary);
 
-    static void filterPointsByStatusMask(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, const std::vector<uchar>& statusMask);
+    /** 
+     * Remove tracks with zero status
+     */
+    static void filterPointsByStatusMask(FlowTracks& tracks);
 
     static void analyzePointsMove(std::vector<cv::Point2f>& inPrevPts, std::vector<cv::Point2f>& inCurrPts, PointsMove& outPointsMove);
 
@@ -0,0 +1,82 @@
+#ifndef FRAME_PREFETCHER_H
+#define FRAME_PREFETCHER_H
+#pragma once
+
+#include "pch.h"
+
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * FramePrefetcher to load source images ahead of solver
+ *
+ * Decoding, downsampling and grayscale conversion run in background thread
+ * Solver consumes prepared images from bounded queue
+ */
+class FramePrefetcher {
+private:
+    struct Frame {
+        cv::Mat imColor, imGray;
+    };
+
+    cv::VideoCapture* m_cap;
+
+    const float m_downSample;
+
+    const uint m_queueSize;
+
+    std::thread m_loadThread;
+
+    std::mutex m_queueMutex;
+
+    std::condition_variable m_queueNotEmpty, m_queueNotFull;
+
+    // prepared frames waiting for solver
+    std::deque<Frame> m_queue;
+
+    // consumed frames returned for buffer reuse
+    std::vector<Frame> m_freeFrames;
+
+    cv::Mat m_imSource;
+
+    bool m_isSourceLost, m_isStopped;
+
+    /**
+     * Read, downsample and convert image to grayscale
+     */
+    bool loadFrame(cv::Mat& imColor, cv::Mat& imGray);
+
+    void prefetch();
+
+    /**
+     * Recycle buffer only if nobody else is referencing it
+     */
+    static bool isReusable(const cv::Mat& mat) { return !mat.empty() && mat.u != NULL && mat.u->refcount == 1; }
+public:
+    /**
+     * FramePrefetcher constructor
+     *
+     * @param cap opened video source
+     * @param downSample downsampling of input source images
+     * @param queueSize number of prepared images ahead -> 0 loads synchronously
+     */
+    FramePrefetcher(cv::VideoCapture* cap, const float downSample, const uint queueSize);
+
+    ~FramePrefetcher();
+
+    void start();
+
+    void stop();
+
+    /**
+     * Get next prepared image
+     *
+     * It waits for background thread, if queue is empty
+     * Output mat buffers are reused for next frames
+     *
+     * @return false if source is lost
+     */
+    bool read(cv::Mat& imColor, cv::Mat& imGray);
+};
+
+#endif //FRAME_PREFETCHER_H
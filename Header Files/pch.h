@@ -5,6 +5,9 @@
 #include <iostream>
 #include <thread>
 #include <chrono>
+#include <deque>
+#include <future>
+#include <unordered_set>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -36,6 +39,12 @@
 #include "ceres/ceres.h"
 #include "ceres/rotation.h"
 
+// bundle adjustment reprojection cost with hand derived jacobians instead of AutoDiff
+// compare both costs by "Test Files/test_reprojection_cost.cpp" before enabling
+#ifndef BA_ANALYTIC_JACOBIANS
+#define BA_ANALYTIC_JACOBIANS false
+#endif
+
 #include <boost/format.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
@@ -6,27 +6,74 @@
 #include "camera.h"
 #include "common.h"
 
-class CloudTrack {
-public:
-    // reference to cloud point
-    cv::Vec3d* ptrPoint3D;
+struct CloudObservation {
+    size_t cloudIdx;
+
+    // extrinsics camera index for mapping
+    uint cameraIdx;
+
+    // 2D projection in the camera
+    cv::Point2f projKey;
+};
 
-    // 2D projections in the camera
-    std::vector<cv::Point2f> projKeys;
+/** 
+ * CloudObservations of all cloud points in one append-only table
+ * 
+ * Rows are appended in registration order -> camera idxs are not decreasing, rows of one camera are contiguous
+ * CSR index of rows for each cloud point is rebuilt lazily after append
+ */
+class CloudObservations {
+private:
+    std::vector<CloudObservation> m_rows;
+
+    size_t m_numPoints;
 
-    // extrinsics camera indexes for mapping
-    std::vector<uint> extrinsicsIdxs;
+    // CSR index -> rows of cloud point i are m_pointRows[m_pointOffsets[i]] ... m_pointRows[m_pointOffsets[i + 1] - 1]
+    mutable std::vector<size_t> m_pointOffsets, m_pointRows;
+
+    mutable size_t m_numIndexedRows;
+public:
+    CloudObservations()
+        : m_numPoints(0), m_numIndexedRows(0) {}
 
-    void addTrack(const cv::Point2f projKey, const uint extrinsicsIdx) {
-        projKeys.push_back(projKey);
-        extrinsicsIdxs.push_back(extrinsicsIdx);
+    void add(const size_t cloudIdx, const uint cameraIdx, const cv::Point2f projKey) {
+        m_rows.push_back({ cloudIdx, cameraIdx, projKey });
+
+        m_numPoints = std::max(m_numPoints, cloudIdx + 1);
     }
 
-    CloudTrack(cv::Vec3d* ptrPoint3D, const cv::Point2f projKey, const uint extrinsicsIdx) {
-        this->ptrPoint3D = ptrPoint3D;
+    /** 
+     * Rebuild CSR index, if rows were appended
+     * It is not thread safe -> call it before parallel point queries
+     */
+    void updatePointIndex() const;
+
+    /** 
+     * Rows of cloud point observations in registration order
+     */
+    const size_t* getPointRows(const size_t cloudIdx, size_t& numRows) const {
+        updatePointIndex();
+
+        if (cloudIdx >= m_numPoints) { numRows = 0; return NULL; }
+
+        numRows = m_pointOffsets[cloudIdx + 1] - m_pointOffsets[cloudIdx];
 
-        addTrack(projKey, extrinsicsIdx);
+        return m_pointRows.data() + m_pointOffsets[cloudIdx];
     }
+
+    /** 
+     * First row registered in camera or in any later camera
+     * Rows of camera c are [getFirstCameraRow(c), getFirstCameraRow(c + 1))
+     */
+    size_t getFirstCameraRow(const uint cameraIdx) const {
+        return std::lower_bound(m_rows.begin(), m_rows.end(), cameraIdx, [](const CloudObservation& obs, const uint idx) { return obs.cameraIdx < idx; }) - m_rows.begin();
+    }
+
+    const CloudObservation& operator[](const size_t row) const { return m_rows[row]; }
+
+    size_t size() const { return m_rows.size(); }
+
+    bool empty() const { return m_rows.empty(); }
 };
 
 class PointCloud {
@@ -38,19 +85,18 @@ class PointCloud {
 
     void applyCloudFilter(std::vector<size_t>& userCloudIdx, std::vector<int>& filter);
 public:
-    std::vector<cv::Vec3d*> cloudMapper;
-
     // Result cloud -> updated by bundle adjuster
-    std::list<cv::Vec3d> cloud3D;
+    // Chunked storage -> point addresses are stable for optimizer
+    ChunkedArray<cv::Vec3d> cloud3D;
 
     // Result cloud colors -> not updated
-    std::list<cv::Vec3b> cloudRGB;
+    ChunkedArray<cv::Vec3b> cloudRGB;
 
     // Cloud render/computing visibility mask
     std::vector<bool> cloudMask;
 
-    // Registered views and projections for each cloud point
-    std::vector<CloudTrack> cloudTracks;
+    // Registered views and projections of all cloud points
+    CloudObservations cloudObservations;
 
     std::vector<uint> cloudUpdates;
 
@@ -60,23 +106,20 @@ public:
         : m_cSRemThr(cSRemThr), m_numCloudPts(0), m_numActiveCloudPts(0), cloudSelectedLayer(0) {}
 
     void addCloudPoint(const cv::Point2f projPosition2D, const cv::Vec3d cloudPoint3D, const cv::Vec3b cloudPointRGB) {
+        // register cloud view of new point
+        cloudObservations.add(cloud3D.size(), cloudSelectedLayer, projPosition2D);
+
         cloud3D.push_back(cloudPoint3D);
         cloudRGB.push_back(cloudPointRGB);
         cloudMask.push_back(true);
         cloudUpdates.push_back(0);
 
-        // create and register cloud view
-        cloudTracks.push_back(CloudTrack(&*cloud3D.rbegin(), projPosition2D, cloudSelectedLayer));
-
-        // map to cloud to enable random access
-        cloudMapper.push_back(&*cloud3D.rbegin());
-
         m_numCloudPts++;
         m_numActiveCloudPts++;
     }
 
     void registerCloudView(const size_t cloudPointIdx, const cv::Point2f projPosition2D) {
-        cloudTracks[cloudPointIdx].addTrack(projPosition2D, cloudSelectedLayer);
+        cloudObservations.add(cloudPointIdx, cloudSelectedLayer, projPosition2D);
     }
 
     void filterCloud();
@@ -137,9 +180,209 @@ struct SnavelyReprojectionError {
     double observed_y;
 };
 
+/** 
+ * SnavelyReprojectionCost with analytic jacobians
+ * 
+ * The same pinhole angle-axis model and residuals as SnavelyReprojectionError
+ * Parameter blocks are intrinsics [fx, fy, ppx, ppy], extrinsics [angle-axis, t] and point
+ */
+class SnavelyReprojectionCost : public ceres::SizedCostFunction<2, 4, 6, 3> {
+public:
+    SnavelyReprojectionCost(const double observed_x, const double observed_y)
+        : observed_x(observed_x), observed_y(observed_y) {}
+
+    bool Evaluate(double const* const* parameters, double* residuals, double** jacobians) const override {
+        const double* intrinsics = parameters[0];
+        const double* extrinsics = parameters[1];
+        const double* point = parameters[2];
+
+        const double& focalX = intrinsics[0];
+        const double& focalY = intrinsics[1];
+
+        double R[9]; ceres::AngleAxisToRotationMatrix(extrinsics, ceres::RowMajorAdapter3x3(R));
+
+        // point in camera coordinates
+        double x[3];
+        for (int i = 0; i < 3; ++i)
+            x[i] = R[i * 3 + 0] * point[0] + R[i * 3 + 1] * point[1] + R[i * 3 + 2] * point[2] + extrinsics[3 + i];
+
+        const double invZ = 1.0 / x[2];
+        const double xn = x[0] * invZ;
+        const double yn = x[1] * invZ;
+
+        residuals[0] = (focalX * xn) + intrinsics[2] - observed_x;
+        residuals[1] = (focalY * yn) + intrinsics[3] - observed_y;
+
+        if (jacobians == NULL) { return true; }
+
+        // residuals derivative by point in camera coordinates
+        const double dX[2][3] = {
+            { focalX * invZ, 0, -focalX * xn * invZ },
+            { 0, focalY * invZ, -focalY * yn * invZ }
+        };
+
+        if (jacobians[0] != NULL) {
+            double* J = jacobians[0];
+
+            J[0] = xn; J[1] = 0;  J[2] = 1; J[3] = 0;
+            J[4] = 0;  J[5] = yn; J[6] = 0; J[7] = 1;
+        }
+
+        // residuals derivative by world point -> dX * R
+        double dP[2][3];
+        for (int r = 0; r < 2; ++r)
+            for (int c = 0; c < 3; ++c)
+                dP[r][c] = dX[r][0] * R[c] + dX[r][1] * R[3 + c] + dX[r][2] * R[6 + c];
+
+        if (jacobians[1] != NULL) {
+            double* J = jacobians[1];
+
+            // rotated point derivative by angle-axis is -R [point]x Jr, Jr is SO3 right jacobian
+            const double theta2 = extrinsics[0] * extrinsics[0] + extrinsics[1] * extrinsics[1] + extrinsics[2] * extrinsics[2];
+
+            double a, b;
+            if (theta2 > std::numeric_limits<double>::epsilon()) {
+                const double theta = std::sqrt(theta2);
+                const double halfSin = std::sin(0.5 * theta);
+
+                // 1 - cos(theta) cancels for small angles -> half angle form keeps full precision
+                a = 2.0 * halfSin * halfSin / theta2;
+                b = (theta - std::sin(theta)) / (theta2 * theta);
+            } else {
+                // Taylor expansion near zero rotation
+                a = 0.5 - theta2 / 24.0;
+                b = 1.0 / 6.0 - theta2 / 120.0;
+            }
+
+            const double W[9] = {
+                0, -extrinsics[2], extrinsics[1],
+                extrinsics[2], 0, -extrinsics[0],
+                -extrinsics[1], extrinsics[0], 0
+            };
+
+            // Jr = I - a [w]x + b [w]x^2
+            double Jr[9];
+            for (int r = 0; r < 3; ++r)
+                for (int c = 0; c < 3; ++c)
+                    Jr[r * 3 + c] = (r == c ? 1.0 : 0.0) - a * W[r * 3 + c] + b * (W[r * 3] * W[c] + W[r * 3 + 1] * W[3 + c] + W[r * 3 + 2] * W[6 + c]);
+
+            // -[point]x Jr -> negative cross product of point and each Jr column
+            double PJ[9];
+            for (int c = 0; c < 3; ++c) {
+                PJ[0 + c] = -(point[1] * Jr[6 + c] - point[2] * Jr[3 + c]);
+                PJ[3 + c] = -(point[2] * Jr[0 + c] - point[0] * Jr[6 + c]);
+                PJ[6 + c] = -(point[0] * Jr[3 + c] - point[1] * Jr[0 + c]);
+            }
+
+            for (int r = 0; r < 2; ++r) {
+                for (int c = 0; c < 3; ++c) {
+                    J[r * 6 + c] = dP[r][0] * PJ[c] + dP[r][1] * PJ[3 + c] + dP[r][2] * PJ[6 + c];
+
+                    // translation is added in camera coordinates
+                    J[r * 6 + 3 + c] = dX[r][c];
+                }
+            }
+        }
+
+        if (jacobians[2] != NULL) {
+            double* J = jacobians[2];
+
+            for (int r = 0; r < 2; ++r)
+                for (int c = 0; c < 3; ++c)
+                    J[r * 3 + c] = dP[r][c];
+        }
+
+        return true;
+    }
+
+    static ceres::CostFunction* Create(const double observed_x, const double observed_y) {
+        return new SnavelyReprojectionCost(observed_x, observed_y);
+    }
+
+    double observed_x;
+    double observed_y;
+};
+
+/** 
+ * BundleSnapshot of map state optimized by one bundle adjustment
+ * 
+ * Solver optimizes own parameter blocks -> map can grow and be tracked meanwhile
+ */
+struct BundleSnapshot {
+    // cameras before window start are held constant
+    uint windowStart, numCameras;
+
+    // number of cloud points at the time of snapshot
+    size_t numCloudPts;
+
+    // cameras locked to prevent cloud scaling
+    std::vector<bool> cameraLocks;
+
+    // optimized cloud point idxs
+    std::vector<size_t> cloudIdxs;
+
+    BundleSnapshot()
+        : windowStart(0), numCameras(0), numCloudPts(0) {}
+};
+
+/** 
+ * MapCheckpoint of cloud points and camera poses overwritten by one map update
+ * 
+ * Only touched blocks are saved -> rollback is O(touched)
+ */
+class MapCheckpoint {
+private:
+    std::vector<size_t> m_cloudIdxs;
+    std::vector<cv::Vec3d> m_cloud3D;
+
+    // list iterators stay valid while cameras are added
+    std::vector<std::list<cv::Matx34d>::iterator> m_cameras;
+    std::vector<cv::Matx34d> m_extrinsics;
+
+    cv::Matx33d m_actualR; cv::Matx31d m_actualT;
+
+    bool m_isActualPoseSaved;
+public:
+    MapCheckpoint()
+        : m_isActualPoseSaved(false) {}
+
+    void saveCloudPoint(const PointCloud& pointCloud, const size_t cloudIdx) {
+        m_cloudIdxs.push_back(cloudIdx);
+        m_cloud3D.push_back(pointCloud.cloud3D[cloudIdx]);
+    }
+
+    void saveCamera(const std::list<cv::Matx34d>::iterator camera) {
+        m_cameras.push_back(camera);
+        m_extrinsics.push_back(*camera);
+    }
+
+    void saveActualPose(const CameraData& cameraData) {
+        m_actualR = cameraData.actualR;
+        m_actualT = cameraData.actualT;
+
+        m_isActualPoseSaved = true;
+    }
+
+    /** 
+     * Restore saved blocks in reverse order -> the oldest saved value wins
+     */
+    void rollback(CameraData& cameraData, PointCloud& pointCloud) const {
+        for (size_t i = m_cloudIdxs.size(); i-- > 0;)
+            pointCloud.cloud3D[m_cloudIdxs[i]] = m_cloud3D[i];
+
+        for (size_t i = m_cameras.size(); i-- > 0;)
+            *m_cameras[i] = m_extrinsics[i];
+
+        if (m_isActualPoseSaved) {
+            cameraData.actualR = m_actualR;
+            cameraData.actualT = m_actualT;
+        }
+    }
+};
+
 class Reconstruction {
 private:
-    const std::string m_triangulateMethod, m_baMethod;
+    const std::string m_baMethod;
 
     const double m_baMaxRMSE;
 
@@ -149,13 +392,107 @@ private:
 
     uint m_numOptimizations;
 
-    void pointsToRGBCloud(CameraParameters camera, cv::Mat imgColor, cv::Matx33d R, cv::Matx31d t, cv::Mat points3D, cv::Mat inputPts2D, std::vector<cv::Vec3d>& cloud3D, std::vector<cv::Vec3b>& cloudRGB, float minDist, float maxDist, float maxProjErr, std::vector<bool>& mask);
+    // long-lived bundle adjustment problem -> parameter blocks are owned here, addresses are stable
+    std::unique_ptr<ceres::Problem> m_baProblem;
+
+    cv::Matx14d m_baIntrinsics4d;
+
+    ChunkedArray<cv::Matx16d> m_baExtrinsics6d;
+    ChunkedArray<cv::Vec3d> m_baCloud3D;
+
+    // camera poses encoded in extrinsics blocks
+    std::vector<cv::Matx34d> m_baPoses;
+    std::vector<bool> m_baIsPoseSynced;
+
+    // number of observation rows already added as residual blocks
+    size_t m_baNumRows;
+
+    // filtered cloud points removed from problem -> their observations are added again if they are visible
+    std::vector<bool> m_baIsPointRemoved;
+
+    // constant/variable state of parameter blocks -> only blocks changing window membership are toggled
+    std::vector<bool> m_baIsPointVariable, m_baIsCameraVariable;
+
+    // points and window start of previous adjustment
+    std::vector<size_t> m_baVariablePts;
+    uint m_baWindowStart;
+
+    // background bundle adjustment -> problem is owned by worker until merged
+    BundleSnapshot m_baSnapshot;
+    std::future<bool> m_baFuture;
+
+    /** 
+     * Sync problem with map and select optimized blocks
+     * 
+     * Residual blocks are added only for new observations, masked cloud points are removed
+     * Only new and changed camera poses are converted to angle-axis
+     * Local mode visits only window points from the end of observation table and points of previous window
+     */
+    bool prepareBundle(CameraData& cameraData, PointCloud& pointCloud, const uint windowSize, BundleSnapshot& snapshot);
+
+    /** 
+     * Optimize prepared problem, it does not touch map
+     * 
+     * @return false if result is not usable or RMSE is worse
+     */
+    bool solveBundle(const BundleSnapshot& snapshot);
+
+    /** 
+     * Write optimized snapshot back to map
+     * Cameras and points added after snapshot are moved by correction of the last optimized camera
+     * 
+     * @param checkpoint overwritten blocks are saved for rollback, if it is set
+     */
+    void applyBundle(const BundleSnapshot& snapshot, CameraData& cameraData, PointCloud& pointCloud, MapCheckpoint* checkpoint = NULL);
 public:
-    Reconstruction(const std::string triangulateMethod, const std::string baMethod, const double baMaxRMSE, const float minDistance, const float maxDistance, const float maxProjectionError, const bool useNormalizePts);
-
-    void triangulateCloud(CameraParameters camera, const std::vector<cv::Point2f> prevPts, const std::vector<cv::Point2f> currPts, const cv::Mat colorImage, std::vector<cv::Vec3d>& points3D, std::vector<cv::Vec3b>& pointsRGB, std::vector<bool>& mask, const cv::Matx34d prevPose, const cv::Matx34d currPose, cv::Matx33d& R, cv::Matx31d& t);
-
-    void adjustBundle(CameraData& cameraData, PointCloud& pointCloud);
+    Reconstruction(const std::string baMethod, const double baMaxRMSE, const float minDistance, const float maxDistance, const float maxProjectionError, const bool useNormalizePts);
+
+    /** 
+     * Triangulate point pairs in one parallel pass
+     * 
+     * Each point is triangulated by linear least squares, reprojected to current camera R, t and coloured from current image
+     * Mask filters bad projected points, points behind camera and points far away from camera
+     */
+    void triangulateCloud(const CameraParameters& camera, const std::vector<cv::Point2f>& prevPts, const std::vector<cv::Point2f>& currPts, const cv::Mat& colorImage, std::vector<cv::Vec3d>& points3D, std::vector<cv::Vec3b>& pointsRGB, std::vector<bool>& mask, const cv::Matx34d& prevPose, const cv::Matx34d& currPose, const cv::Matx33d& R, const cv::Matx31d& t);
+
+    /** 
+     * Re-estimate cloud points observed in at least minViews cameras
+     * 
+     * N-view DLT is refined by Gauss-Newton on pixel reprojection error, each point in parallel
+     * Point is replaced only if it is in front of all cameras and its reprojection error is lower
+     * 
+     * @param windowSize only points observed by the last windowSize cameras are processed, 0 for all points
+     */
+    void retriangulateCloud(CameraData& cameraData, PointCloud& pointCloud, const uint minViews, const uint windowSize = 0);
+
+    /** 
+     * Bundle adjustment of cameras and cloud points
+     * 
+     * Local mode optimizes only the last windowSize cameras and points observed by them
+     * Older cameras co-observing these points are added, but held constant
+     * 
+     * @param windowSize number of last cameras to optimize, 0 optimizes all cameras
+     */
+    void adjustBundle(CameraData& cameraData, PointCloud& pointCloud, const uint windowSize = 0);
+
+    /** 
+     * Start bundle adjustment of map snapshot in background thread
+     * 
+     * @return false if previous one is still running or map is not ready
+     */
+    bool adjustBundleAsync(CameraData& cameraData, PointCloud& pointCloud, const uint windowSize = 0);
+
+    /** 
+     * Merge finished background bundle adjustment to map
+     * 
+     * Merge is rolled back, if it is worse for observations registered during optimization
+     * 
+     * @param waitForResult block until running bundle adjustment is finished
+     * @return true if optimized map was merged
+     */
+    bool mergeBundle(CameraData& cameraData, PointCloud& pointCloud, const bool waitForResult = false);
+
+    bool isBundleAdjusting() const { return m_baFuture.valid(); }
 };
 
 #endif //RECONSTRUCTION_H
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include "view.h"
 #include "feature_processing.h"
 #include "camera.h"
+#include "descriptor_index.h"
 
 /** 
  * RecoveryPose helper
@@ -31,36 +32,134 @@ public:
     void drawRecoveredPose(cv::Mat inputImg, cv::Mat& outputImg, const std::vector<cv::Point2f> prevPts, const std::vector<cv::Point2f> currPts, cv::Mat mask = cv::Mat());
 };
 
+/** 
+ * DescriptorArena to store descriptors of all TrackViews
+ * 
+ * Descriptors are appended in bulk to preallocated chunks
+ * Each view references contiguous row range of one chunk, chunks are never reallocated
+ */
+class DescriptorArena {
+private:
+    static constexpr int CHUNK_ROWS = 8192;
+
+    std::vector<cv::Mat> m_chunks;
+
+    // used rows of the last chunk
+    int m_numChunkRows;
+public:
+    DescriptorArena() 
+        : m_numChunkRows(0) {}
+
+    /** 
+     * Copy selected descriptor rows to arena
+     * 
+     * @return header of contiguous rows in arena
+     */
+    cv::Mat append(const cv::Mat& descriptor, const std::vector<int>& rowIdxs);
+};
+
+/** 
+ * Map from keypoint idx of registered view to cloud point idx
+ * 
+ * Keypoint idxs are dense -> flat table with SIZE_MAX for unmapped keypoints
+ */
+class PtToCloudMap {
+private:
+    std::vector<size_t> m_cloudIdxs;
+
+    size_t m_size;
+public:
+    PtToCloudMap() 
+        : m_size(0) {}
+
+    /** 
+     * Make room for keypoint idxs up to numKeys
+     */
+    void reserve(const size_t numKeys) {
+        if (numKeys > m_cloudIdxs.size()) { m_cloudIdxs.resize(numKeys, SIZE_MAX); }
+    }
+
+    /** 
+     * @return pointer to cloud point idx or NULL if keypoint is not mapped
+     */
+    const size_t* find(const size_t keyIdx) const {
+        if (keyIdx >= m_cloudIdxs.size() || m_cloudIdxs[keyIdx] == SIZE_MAX) { return NULL; }
+
+        return &m_cloudIdxs[keyIdx];
+    }
+
+    /** 
+     * @return false if keypoint is already mapped -> mapped idx is not changed
+     */
+    bool insert(const size_t keyIdx, const size_t cloudIdx) {
+        reserve(keyIdx + 1);
+
+        if (m_cloudIdxs[keyIdx] != SIZE_MAX) { return false; }
+
+        m_cloudIdxs[keyIdx] = cloudIdx;
+
+        m_size++;
+
+        return true;
+    }
+
+    void clear() {
+        std::fill(m_cloudIdxs.begin(), m_cloudIdxs.end(), SIZE_MAX);
+
+        m_size = 0;
+    }
+
+    /** 
+     * Clear and free table memory
+     */
+    void release() {
+        std::vector<size_t>().swap(m_cloudIdxs);
+
+        m_size = 0;
+    }
+
+    size_t size() const { return m_size; }
+
+    bool empty() const { return m_size == 0; }
+};
+
 /** 
  * TrackView helper used for PnP matching
  * 
  * Only good tracks with cloud reference are created
+ * TrackView is stored for the whole run, so it does not reference ViewDataContainer images
  */
 class TrackView : public View {
 public:
-    std::map<std::pair<float, float>, size_t> ptToCloudMap;
+    PtToCloudMap ptToCloudMap;
 
     // Each point is mapped to world point cloud idx
     std::vector<size_t> cloudIdxs;
     
     // KeyPoints and descriptors for PnP matching
+    // descriptor references rows in DescriptorArena
     std::vector<cv::KeyPoint> keyPoints;
     cv::Mat descriptor;
-
-    void addTrack(const cv::KeyPoint keyPoint, cv::Mat descriptor, size_t cloudIdx) {
-        this->keyPoints.push_back(keyPoint);
-        this->descriptor.push_back(descriptor);
-
-        this->cloudIdxs.push_back(cloudIdx);
-    }
 };
 
 class Tracking {
-    // CloudTracks same size as cloud3D
-    // Cameras and 2D point projections which affect cloud
-    std::vector<CloudTrack> m_cloudTracks;
-
     PointCloud* m_pointCloud;
+
+    // Descriptors of all track views
+    DescriptorArena m_descArena;
+
+    // Descriptors of all track views for map-wide PnP matching
+    DescriptorIndex m_descIndex;
+
+    /** 
+     * Sum of squared reprojection errors of 2D-3D correspondences for rotation vector and translation
+     */
+    static double inlierReprojectionError(CameraParameters camera, const std::vector<cv::Point2f>& points2D, const std::vector<cv::Vec3d>& points3D, const cv::Mat& R, const cv::Mat& t);
+
+    /** 
+     * Solve PnP for 2D-3D correspondences
+     */
+    static bool solveCameraPose(CameraParameters camera, RecoveryPose& recPose, const std::vector<cv::Point2f>& posePoints2D, const std::vector<cv::Vec3d>& posePoints3D, const cv::Matx34d* poseGuess = NULL, const uint numIter = 0);
 public:
     // Good track used for matching
     std::list<TrackView> trackViews;
@@ -69,7 +168,7 @@ public:
         m_pointCloud = pointCloud;
     }
 
-    bool addTrackView(ViewData* view, TrackView trackView, const std::vector<bool>& mask, const std::vector<cv::Point2f>& points2D, const std::vector<cv::Vec3d> points3D, const std::vector<cv::Vec3b>& pointsRGB, const std::vector<cv::KeyPoint>& keyPoints, const cv::Mat& descriptor, const std::vector<int>& ptsToKeyIdx = std::vector<int>());
+    bool addTrackView(TrackView&& trackView, const std::vector<bool>& mask, const std::vector<cv::Point2f>& points2D, const std::vector<cv::Vec3d>& points3D, const std::vector<cv::Vec3b>& pointsRGB, const std::vector<cv::KeyPoint>& keyPoints, const cv::Mat& descriptor, const std::vector<int>& ptsToKeyIdx = std::vector<int>());
 
     std::list<TrackView>& getTrackViews() { return *&trackViews; }
 
@@ -86,6 +185,19 @@ public:
      * It uses PnP alghoritm to return camera pose
      */
     static bool findRecoveredCameraPose(DescriptorMatcher matcher, int minMatches, int maxTrackIter, CameraParameters camera, FeatureView& featView, RecoveryPose& recPose, std::list<TrackView>& inTrackViews, TrackView& outTrackView, PointCloud& pointCloud);
+
+    /** 
+     * Find pose against all trackViews 
+     * It matches view by one query to global descriptor index and uses PnP alghoritm to return camera pose
+     */
+    bool findIndexedCameraPose(const float ratioThreshold, CameraParameters camera, FeatureView& featView, RecoveryPose& recPose, TrackView& outTrackView, PointCloud& pointCloud);
+
+    /** 
+     * Find pose by guided matching
+     * Cloud points of recent trackViews are projected by predicted pose and matched only to keypoints around projection
+     * PnP starts from predicted pose with reduced number of iterations
+     */
+    bool findGuidedCameraPose(const float ratioThreshold, const float searchRadius, const uint numIter, const int maxTrackIter, CameraParameters camera, const cv::Matx34d& predictedPose, FeatureView& featView, RecoveryPose& recPose, TrackView& outTrackView, PointCloud& pointCloud);
 };
 
 #endif //TRACKING_H
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 #include "pch.h"
 #include "reconstruction.h"
+#include "feature_processing.h"
 
 /** 
  * UserInput to managing selected points
@@ -22,12 +23,22 @@ private:
 
     bool m_isClickPtsLocked;
 
+    // flow track ids of user points -> distinguished from corners
+    static constexpr size_t m_clickPtsIdOffset = SIZE_MAX / 4;
+    static constexpr size_t m_usrPtsIdOffset = SIZE_MAX / 2;
+
     void drawSelectedPoint(const cv::Point point) {
+        // nothing to draw in headless mode
+        if (m_inputImage->empty()) { return; }
+
         // draw red point to image
         cv::circle(*m_inputImage, point, m_pointSize, CV_RGB(200, 0, 0), cv::FILLED, cv::LINE_AA);
     }
 
     void drawRecoveredPoint(const cv::Point point) {
+        // nothing to draw in headless mode
+        if (m_inputImage->empty()) { return; }
+
         // draw green point to image
         cv::circle(*m_inputImage, point, m_pointSize, CV_RGB(150, 200, 0), cv::FILLED, cv::LINE_AA);
     }
@@ -78,6 +89,11 @@ public:
      */
     void filterPointsByBoundary(const cv::Rect boundary, const uint offset);
 
+    /** 
+     * Keep user points in cloud -> prevent them from filtering
+     */
+    void keepCloudPoints();
+
     /** 
      * Recover points from 2D
      */
@@ -88,9 +104,15 @@ public:
      */
     void recoverPoints(cv::Mat& imOutUsr, cv::Mat cameraK, cv::Mat R, cv::Mat t);
 
-    void attachPointsToMove(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, std::vector<uchar>& statusMask, bool clickPts, bool usrPts);
+    /** 
+     * Append user points to flow tracks
+     */
+    void attachPointsToMove(FlowTracks& tracks, bool clickPts, bool usrPts);
 
-    void detachPointsFromMove(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, std::vector<uchar>& statusMask, bool clickPts, bool usrPts);
+    /** 
+     * Take moved user points from flow tracks by their ids
+     */
+    void detachPointsFromMove(FlowTracks& tracks, bool clickPts, bool usrPts);
 };
 
 #endif //USR_INP_MANAGER_H
\ No newline at end of file
@@ -5,21 +5,67 @@
 #include "pch.h"
 
 class ViewData {
+private:
+    cv::Size m_pyrWinSize;
+
+    int m_pyrMaxLevel;
+
+    bool m_isPyrValid;
 public:
     cv::Mat imColor, imGray;
 
-    ViewData() {}
+    // Lucas-Kanade pyramid of imGray -> shared by all flow computations of this view
+    std::vector<cv::Mat> imPyramid;
+
+    ViewData() 
+        : m_pyrMaxLevel(0), m_isPyrValid(false) {}
+
+    /** 
+     * Exchange image buffers without copying
+     */
+    void swap(ViewData& other) {
+        std::swap(imColor, other.imColor);
+        std::swap(imGray, other.imGray);
+        std::swap(imPyramid, other.imPyramid);
+
+        std::swap(m_pyrWinSize, other.m_pyrWinSize);
+        std::swap(m_pyrMaxLevel, other.m_pyrMaxLevel);
+        std::swap(m_isPyrValid, other.m_isPyrValid);
+    }
+
+    /** 
+     * Get optical flow pyramid, it is built only once per image
+     */
+    const std::vector<cv::Mat>& getPyramid(const cv::Size winSize, const int maxLevel) {
+        if (!m_isPyrValid || m_pyrWinSize != winSize || m_pyrMaxLevel != maxLevel) {
+            // pyramid buffers are reused if the image size does not change
+            cv::buildOpticalFlowPyramid(imGray, imPyramid, winSize, maxLevel);
+
+            m_pyrWinSize = winSize;
+            m_pyrMaxLevel = maxLevel;
+            m_isPyrValid = true;
+        }
 
-    ViewData(cv::Mat imColor, cv::Mat imGray) {
-        imColor.copyTo(this->imColor);
-        imGray.copyTo(this->imGray);
+        return imPyramid;
     }
+
+    /** 
+     * Call after imGray is changed
+     */
+    void invalidatePyramid() { m_isPyrValid = false; }
 };
 
+/** 
+ * View references slot of ViewDataContainer
+ * 
+ * viewPtr is valid only for containerBufferSize newer views, then the slot is reused
+ */
 class View {
 public:
     ViewData* viewPtr;
 
+    View() : viewPtr(NULL) {}
+
     void setView(ViewData* view) { this->viewPtr = view; }
 };
 
@@ -27,36 +73,46 @@ public:
  * ViewDataContainer to store views (images)
  * 
  * View components are referencing to ViewDataContainer
+ * Views are stored in ring of slots, slots are reused in place
+ * Slot address never changes, its content is replaced after containerBufferSize newer items
  */
 class ViewDataContainer {
 private:
     const uint m_containerBufferSize;
 
+    // deque does not move items on push_back -> ViewData pointers stay valid
+    std::deque<ViewData> m_dataContainer;
+
+    size_t m_lastIdx;
 public:
-    std::list<ViewData> m_dataContainer;
     /** ViewDataContainer constructor
      * 
-     * @param containerBufferSize buffer size to clear memory
+     * @param containerBufferSize number of slots to reuse, at least two views are kept
     */
     ViewDataContainer(const uint containerBufferSize = INT32_MAX)
-        : m_containerBufferSize(containerBufferSize) {}
+        : m_containerBufferSize(std::max(containerBufferSize, 2u)), m_lastIdx(0) {}
+
+    /** 
+     * Move view images to the next slot
+     * 
+     * Input viewData receives buffers of the oldest slot to load next images into them
+     */
+    ViewData* addItem(ViewData& viewData) { 
+        if (m_dataContainer.size() < m_containerBufferSize) {
+            m_dataContainer.emplace_back();
 
-    void addItem(ViewData viewData) { 
-        if (m_dataContainer.size() > m_containerBufferSize - 1) {
-            std::list<ViewData> _dataContainer;
+            m_lastIdx = m_dataContainer.size() - 1;
+        } else 
+            m_lastIdx = (m_lastIdx + 1) % m_containerBufferSize;
 
-            _dataContainer.push_back(*++m_dataContainer.rbegin());
-            _dataContainer.push_back(*m_dataContainer.rbegin());
-            
-            std::swap(m_dataContainer, _dataContainer);
-        }  
+        m_dataContainer[m_lastIdx].swap(viewData);
 
-        m_dataContainer.push_back(viewData); 
+        return &m_dataContainer[m_lastIdx];
     }
 
-    ViewData* getLastOneItem() { return &*m_dataContainer.rbegin(); }
+    ViewData* getLastOneItem() { return &m_dataContainer[m_lastIdx]; }
 
-    ViewData* getLastButOneItem() { return &*++m_dataContainer.rbegin(); }
+    ViewData* getLastButOneItem() { return &m_dataContainer[(m_lastIdx + m_dataContainer.size() - 1) % m_dataContainer.size()]; }
 
     bool isEmpty() { return m_dataContainer.empty(); }
 };
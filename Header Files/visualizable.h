@@ -15,7 +15,7 @@ protected:
 public:
     virtual bool isViewerInitialized() const = 0;
 
-    //virtual void updatePointCloud(const std::list<cv::Vec3d>& points3D, const std::list<cv::Vec3b>& pointsRGB, std::vector<bool>& pointsMask) = 0;
+    //virtual void updatePointCloud(const ChunkedArray<cv::Vec3d>& points3D, const ChunkedArray<cv::Vec3b>& pointsRGB, std::vector<bool>& pointsMask) = 0;
 
     virtual void addPoints(const std::vector<cv::Vec3d> points3D) = 0;
 
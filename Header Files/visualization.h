@@ -36,7 +36,7 @@ public:
 
     bool isViewerInitialized() const;
     
-    void updatePointCloud(const std::list<cv::Vec3d>& points3D, const std::list<cv::Vec3b>& pointsRGB, std::vector<bool>& pointsMask);
+    void updatePointCloud(const ChunkedArray<cv::Vec3d>& points3D, const ChunkedArray<cv::Vec3b>& pointsRGB, std::vector<bool>& pointsMask);
 
     void addPoints(const std::vector<cv::Vec3d> points3D);
     
@@ -80,7 +80,7 @@ public:
 
     bool isViewerInitialized() const;
 
-    void updatePointCloud(const std::list<cv::Vec3d>& points3D, const std::list<cv::Vec3b>& pointsRGB, std::vector<bool>& pointsMask);
+    void updatePointCloud(const ChunkedArray<cv::Vec3d>& points3D, const ChunkedArray<cv::Vec3b>& pointsRGB, std::vector<bool>& pointsMask);
     
     void addPoints(const std::vector<cv::Vec3d> points3D);
 
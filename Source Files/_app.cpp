@@ -15,11 +15,15 @@ int main(int argc, char** argv) {
         "{ bWinHeight| 540         | debug windows height }"
         "{ bUseMethod| PNP         | method to use KLT/VO/PNP }"
         "{ bMaxSkFram| 10          | max number of skipped frames to swap }"
+        "{ bPrefetch | 4           | number of images prepared ahead in background, 0 loads synchronously }"
         "{ bDebugVisE| true        | enable debug point cloud visualization by VTK, PCL }"
         "{ bDebugMatE| false       | enable debug matching visualization by GTK/... }"
+        "{ bHeadless | false       | disable all windows, debug drawing and MJPEG stream for batch processing }"
 
         "{ fDecType  | AKAZE       | used detector type }"
-        "{ fMatchType| BRUTEFORCE_HAMMING  | used matcher type }"
+        "{ fTileGrid | 0           | feature extraction tiles per image side processed in parallel, 0 or 1 extracts in whole image }"
+        "{ fTileKPts | 0           | feature extraction max keypoints per tile, 0 keeps all }"
+        "{ fMatchType| BRUTEFORCE_HAMMING  | used matcher type BRUTEFORCE/BRUTEFORCE_SL2/BRUTEFORCE_HAMMING/BRUTEFORCE_HAMMING_SIMD/FLANNBASED }"
         "{ fKnnRatio | 0.5         | knn ration match }"
 
         "{ ofMinKPts | 333         | optical flow min descriptor to generate new one }"
@@ -31,26 +35,36 @@ int main(int argc, char** argv) {
         "{ ofMaxCorn | 2000        | optical flow max generated corners }"
         "{ ofQualLvl | 0.1         | optical flow generated corners quality level }"
         "{ ofMinDist | 5           | optical flow generated corners min distance }"
+        "{ ofNumThr  | 0           | optical flow number of point chunks tracked in parallel, 0 or 1 tracks on single thread }"
+        "{ ofGridSize| 0           | optical flow corners replenishment grid cells per image side, 0 detects in whole image }"
+        "{ ofCellCorn| 50          | optical flow max corners per grid cell }"
 
         "{ peMethod  | RANSAC      | pose estimation fundamental matrix computation method [RANSAC/LMEDS] }"
         "{ peProb    | 0.99        | pose estimation confidence/probability }"
         "{ peThresh  | 0.5         | pose estimation threshold }"
+        "{ peMinParal| 0.0         | pose estimation min median flow move in pixels to compute essential matrix, 0 disables the check }"
         "{ peMinInl  | 10          | pose estimation in number of homography inliers user for reconstruction }"
         "{ peMinMatch| 50          | pose estimation min matches to break }"
         "{ peTMaxIter| 1           | pose estimation max track iteration }"
+        "{ peGuidRad | 20.0        | pose estimation guided matching search radius in pixels around projected cloud points, 0 disables guided matching }"
+        "{ peGuidIter| 50          | pose estimation guided matching max PnP iteration }"
        
         "{ pePMetrod | SOLVEPNP_P3P| pose estimation method ITERATIVE/SOLVEPNP_P3P/SOLVEPNP_AP3P/SOLVEPNP_EPNP }"
         "{ peExGuess | false       | pose estimation use extrinsic guess }"
+        "{ peIdxMatch| true        | pose estimation match against descriptor index of all track views }"
         "{ peNumIteR | 500         | pose estimation max iteration }"
 
         "{ baMethod  | SPARSE_NORMAL_CHOLESKY | bundle adjustment solver type DENSE_SCHUR/SPARSE_NORMAL_CHOLESKY }"
         "{ baMaxRMSE | 10.0        | bundle adjustment max RMSE error to recover from back up }"
         "{ baProcIt  | 5           | bundle adjustment process each %d iteration }"
+        "{ baWinSize | 10          | bundle adjustment local window of last cameras, 0 adjusts all cameras }"
+        "{ baFullIt  | 25          | bundle adjustment of all cameras process each %d iteration, 0 disables }"
+        "{ baAsync   | true        | bundle adjustment runs in background thread and is merged in later iteration }"
 
-        "{ tMethod   | ITERATIVE   | triangulation method ITERATIVE/DLT }"
         "{ tMinDist  | 0.0001      | triangulation points min distance }"
         "{ tMaxDist  | 250         | triangulation points max distance }"
         "{ tMaxPErr  | 3.0         | triangulation points max reprojection error }"
+        "{ tMinViews | 3           | triangulation min views to retriangulate cloud points before bundle adjustment, 0 disables retriangulation }"
 
         "{ cSRemThr  | 1.00        | statistical outlier removal stddev multiply threshold }"
         "{ cLSize    | 0.25        | cloud leaf filter size }"
@@ -72,11 +86,15 @@ int main(int argc, char** argv) {
     const int bWinHeight = parser.get<int>("bWinHeight");
     const std::string bUseMethod = parser.get<std::string>("bUseMethod");
     const int bMaxSkFram = parser.get<int>("bMaxSkFram");
+    const int bPrefetch = parser.get<int>("bPrefetch");
     const bool bDebugVisE = parser.get<bool>("bDebugVisE");
     const bool bDebugMatE = parser.get<bool>("bDebugMatE");
+    const bool bHeadless = parser.get<bool>("bHeadless");
 
     //------------------------------- FEATURES ------------------------------//
     const std::string fDecType = parser.get<std::string>("fDecType");
+    const int fTileGrid = parser.get<int>("fTileGrid");
+    const int fTileKPts = parser.get<int>("fTileKPts");
     const std::string fMatchType = parser.get<std::string>("fMatchType");
     const float fKnnRatio = parser.get<float>("fKnnRatio");
 
@@ -90,29 +108,39 @@ int main(int argc, char** argv) {
     const int ofMaxCorn = parser.get<int>("ofMaxCorn");
     const float ofQualLvl = parser.get<float>("ofQualLvl");
     const float ofMinDist = parser.get<float>("ofMinDist");
+    const int ofNumThr = parser.get<int>("ofNumThr");
+    const int ofGridSize = parser.get<int>("ofGridSize");
+    const int ofCellCorn = parser.get<int>("ofCellCorn");
 
     //--------------------------- POSE ESTIMATION ---------------------------//
     const std::string peMethod = parser.get<std::string>("peMethod");
     const float peProb = parser.get<float>("peProb");
     const float peThresh = parser.get<float>("peThresh");
+    const float peMinParal = parser.get<float>("peMinParal");
     const int peMinInl = parser.get<int>("peMinInl");
     const int peMinMatch = parser.get<int>("peMinMatch");
     const int peTMaxIter = parser.get<int>("peTMaxIter");
+    const float peGuidRad = parser.get<float>("peGuidRad");
+    const int peGuidIter = parser.get<int>("peGuidIter");
 
     const std::string pePMetrod = parser.get<std::string>("pePMetrod");
     const bool peExGuess = parser.get<bool>("peExGuess");
+    const bool peIdxMatch = parser.get<bool>("peIdxMatch");
     const int peNumIteR = parser.get<int>("peNumIteR");
 
     //-------------------------- BUNDLE ADJUSTMENT --------------------------//
     const std::string baMethod = parser.get<std::string>("baMethod");
     const double baMaxRMSE = parser.get<double>("baMaxRMSE");
     const int baProcIt = parser.get<int>("baProcIt");
+    const int baWinSize = parser.get<int>("baWinSize");
+    const int baFullIt = parser.get<int>("baFullIt");
+    const bool baAsync = parser.get<bool>("baAsync");
 
     //---------------------------- TRIANGULATION ----------------------------//
-    const std::string tMethod = parser.get<std::string>("tMethod");
     const float tMinDist = parser.get<float>("tMinDist");
     const float tMaxDist = parser.get<float>("tMaxDist");
     const float tMaxPErr = parser.get<float>("tMaxPErr");
+    const int tMinViews = parser.get<int>("tMinViews");
 
     //----------------------------- CLOUD FILTER ----------------------------//
     const float cSRemThr = parser.get<float>("cSRemThr");
@@ -135,7 +163,7 @@ int main(int argc, char** argv) {
     const std::string recPoseWinName = "Recovery pose";
     const std::string matchesWinName = "Matches";
 
-    AppSolver solver(AppSolverDataParams(bUseMethod, ptCloudWinName, usrInpWinName, recPoseWinName, matchesWinName, bSource, bDownSamp, bMaxSkFram, cv::Size(bWinWidth, bWinHeight), cv::Size(cameraWidth, cameraHeight), bDebugVisE, bDebugMatE, fDecType, fMatchType, fKnnRatio, ofMinKPts, ofWinSize, ofMaxLevel, ofMaxItCt, ofItEps, ofMaxError, ofMaxCorn, ofQualLvl, ofMinDist, peMethod, peProb, peThresh, peMinInl, peMinMatch, pePMetrod, peExGuess, peNumIteR, peTMaxIter, baMethod, baMaxRMSE, baProcIt, tMethod, tMinDist, tMaxDist, tMaxPErr, cameraK, distCoeffs, cSRemThr, cLSize, cSRange, cFProcIt));
+    AppSolver solver(AppSolverDataParams(bUseMethod, ptCloudWinName, usrInpWinName, recPoseWinName, matchesWinName, bSource, bDownSamp, bMaxSkFram, bPrefetch, cv::Size(bWinWidth, bWinHeight), cv::Size(cameraWidth, cameraHeight), bDebugVisE, bDebugMatE, bHeadless, fDecType, fTileGrid, fTileKPts, fMatchType, fKnnRatio, ofMinKPts, ofWinSize, ofMaxLevel, ofMaxItCt, ofItEps, ofMaxError, ofMaxCorn, ofQualLvl, ofMinDist, ofNumThr, ofGridSize, ofCellCorn, peMethod, peProb, peThresh, peMinParal, peMinInl, peMinMatch, pePMetrod, peExGuess, peIdxMatch, peNumIteR, peTMaxIter, peGuidRad, peGuidIter, baMethod, baMaxRMSE, baProcIt, baWinSize, baFullIt, baAsync, tMinDist, tMaxDist, tMaxPErr, tMinViews, cameraK, distCoeffs, cSRemThr, cLSize, cSRange, cFProcIt));
 
 #pragma endregion INIT 
     std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
@@ -1,90 +1,107 @@
 #include "app_solver.h"
 
-int AppSolver::prepareImage(cv::VideoCapture& cap, cv::Mat& imColor, cv::Mat& imGray) {
-    if (!cap.read(imColor)) 
+int AppSolver::prepareImage(FramePrefetcher& frameLoader, ViewData& view) {
+    // images are already downsampled and converted by prefetcher
+    if (!frameLoader.read(view.imColor, view.imGray)) 
         return ImageFindState::SOURCE_LOST;
 
-    if (params.bDownSamp != 1.0f)
-        cv::resize(imColor, imColor, cv::Size(imColor.cols/params.bDownSamp, imColor.rows/params.bDownSamp));
-
-    cv::cvtColor(imColor, imGray, cv::COLOR_BGR2GRAY);
+    view.invalidatePyramid();
 
     return ImageFindState::FOUND;
 }
 
-int AppSolver::findGoodImages(cv::VideoCapture cap, ViewDataContainer& viewContainer) {
-    cv::Mat _imColor, _imGray;
-
+int AppSolver::findGoodImages(FramePrefetcher& frameLoader, ViewDataContainer& viewContainer) {
     ImageFindState state;
 
     if (viewContainer.isEmpty()) {
-        if ((state = (ImageFindState)prepareImage(cap, _imColor, _imGray)) 
+        if ((state = (ImageFindState)prepareImage(frameLoader, m_nextView)) 
         != ImageFindState::FOUND) 
             return state;
 
-        viewContainer.addItem(ViewData(_imColor, _imGray));
+        viewContainer.addItem(m_nextView);
     }
 
-    if ((state = (ImageFindState)prepareImage(cap, _imColor, _imGray)) 
+    if ((state = (ImageFindState)prepareImage(frameLoader, m_nextView)) 
         != ImageFindState::FOUND) 
         return state; 
 
-    viewContainer.addItem(ViewData(_imColor, _imGray));
+    viewContainer.addItem(m_nextView);
 
     return state;
 }
 
-int AppSolver::findGoodImages(cv::VideoCapture& cap, ViewDataContainer& viewContainer, FeatureDetector featDetector, OptFlow optFlow, CameraParameters camera, RecoveryPose& recPose, FlowView& ofPrevView, FlowView& ofCurrView) {
+int AppSolver::findGoodImages(FramePrefetcher& frameLoader, ViewDataContainer& viewContainer, FeatureDetector featDetector, OptFlow optFlow, CameraParameters camera, RecoveryPose& recPose, FlowView& ofPrevView, FlowView& ofCurrView) {
     std::cout << "Finding good images" << std::flush;
 
-    std::vector<cv::Point2f> _prevCorners, _currCorners;
-    cv::Mat _imColor, _imGray;
+    FlowTracks _flowTracks;
+
+    std::vector<float> _flowMoves;
 
     // search for a good pair of images by min homography inliers -> use optical flow
-    int numHomInliers = 0, numSkippedFrames = -1;
-    do {
+    int numHomInliers = 0, numSkippedFrames = -1, numParallaxRejected = 0;
+    while (true) {
         ImageFindState state;
 
-        if ((state = (ImageFindState)prepareImage(cap, _imColor, _imGray)) != ImageFindState::FOUND)
+        if ((state = (ImageFindState)prepareImage(frameLoader, m_nextView)) != ImageFindState::FOUND)
             return state;
 
         std::cout << "." << std::flush;
         
         // if there is nothing to compare, prepare the first image
         if (viewContainer.isEmpty()) {
-            viewContainer.addItem(ViewData(_imColor, _imGray));
+            viewContainer.addItem(m_nextView);
 
-            featDetector.generateFlowFeatures(_imGray, ofPrevView.corners, optFlow.additionalSettings.maxCorn, optFlow.additionalSettings.qualLvl, optFlow.additionalSettings.minDist);
+            featDetector.generateFlowFeatures(viewContainer.getLastOneItem()->imGray, ofPrevView.corners, optFlow.additionalSettings.maxCorn, optFlow.additionalSettings.qualLvl, optFlow.additionalSettings.minDist, optFlow.additionalSettings.gridSize, optFlow.additionalSettings.cellMaxCorn);
 
-            if ((state = (ImageFindState)prepareImage(cap, _imColor, _imGray)) != ImageFindState::FOUND)
+            if ((state = (ImageFindState)prepareImage(frameLoader, m_nextView)) != ImageFindState::FOUND)
                 return state;
         }
 
-        // set corners from back up -> computeFlow func removes corners
-        _prevCorners = ofPrevView.corners;
-        _currCorners = ofCurrView.corners;
+        // set corners from back up -> filters remove tracks
+        _flowTracks.setPoints(ofPrevView.corners);
  
         // flow computing with boundary and error filtering
-        optFlow.computeFlow(viewContainer.getLastOneItem()->imGray, _imGray, _prevCorners, _currCorners, optFlow.statusMask); 
-        ProcesingAdds::filterPointsByStatusMask(_prevCorners, _currCorners, optFlow.statusMask);
-        ProcesingAdds::filterPointsByBoundary(_prevCorners, _currCorners, m_boundary);
+        // previous pyramid is cached -> built only once for all candidates
+        optFlow.computeFlow(viewContainer.getLastOneItem(), &m_nextView, _flowTracks); 
+        ProcesingAdds::filterPointsByStatusMask(_flowTracks);
+        ProcesingAdds::filterPointsByBoundary(_flowTracks, m_boundary);
 
         numSkippedFrames++;
 
         if (numSkippedFrames > params.bMaxSkFram) {
-            viewContainer.addItem(ViewData(_imColor, _imGray));
+            viewContainer.addItem(m_nextView);
+
+            std::cout << " - Parallax rejected: " << numParallaxRejected << "\t" << std::flush;
 
             return ImageFindState::NOT_FOUND;
         }
-    } while(!Tracking::findCameraPose(recPose, _prevCorners, _currCorners, camera.K, recPose.minInliers, numHomInliers));
+
+        // cheap parallax check by median flow move -> skip essential matrix RANSAC for near static frames
+        if (params.peMinParal > 0.0f && !_flowTracks.prevPts.empty()) {
+            _flowMoves.resize(_flowTracks.prevPts.size());
+
+            for (size_t i = 0; i < _flowMoves.size(); ++i)
+                _flowMoves[i] = cv::norm(_flowTracks.currPts[i] - _flowTracks.prevPts[i]);
+
+            // median by partial sort -> no full sort or move statistics needed
+            std::nth_element(_flowMoves.begin(), _flowMoves.begin() + _flowMoves.size() / 2, _flowMoves.end());
+
+            if (_flowMoves[_flowMoves.size() / 2] < params.peMinParal) {
+                numParallaxRejected++;
+
+                continue;
+            }
+        }
+
+        if (Tracking::findCameraPose(recPose, _flowTracks.prevPts, _flowTracks.currPts, camera.K, recPose.minInliers, numHomInliers)) { break; }
+    }
 
     // complete the search for image pairs -> set flow views
-    viewContainer.addItem(ViewData(_imColor, _imGray));
+    viewContainer.addItem(m_nextView);
 
-    ofPrevView.setCorners(_prevCorners);
-    ofCurrView.setCorners(_currCorners);
+    _flowTracks.releasePoints(ofPrevView.corners, ofCurrView.corners);
 
-    std::cout << "[DONE]" << " - Inliers count: " << numHomInliers << "; Skipped frames: " << numSkippedFrames << "\t" << std::flush;
+    std::cout << "[DONE]" << " - Inliers count: " << numHomInliers << "; Skipped frames: " << numSkippedFrames << "; Parallax rejected: " << numParallaxRejected << "\t" << std::flush;
 
     return ImageFindState::FOUND;
 }
@@ -96,26 +113,38 @@ void AppSolver::run() {
         exit(1);
     }
     
-    MJPEGWriter wri(7777); wri.start();
+    // decode source images in background -> overlap with computing
+    FramePrefetcher frameLoader(&cap, params.bDownSamp, params.bPrefetch); frameLoader.start();
+
+    // headless mode -> no windows, viewer threads, debug images and stream
+    const bool isVisEnabled = !params.bHeadless;
+    const bool isMatchVisEnabled = params.bDebugMatE && isVisEnabled;
+
+    std::unique_ptr<MJPEGWriter> wri;
+    
+    if (isVisEnabled) { 
+        wri = std::make_unique<MJPEGWriter>(7777); wri->start(); 
+    }
     
     // initialize structures
     CameraParameters camera(params.cameraK, params.distCoeffs, params.bDownSamp);
     CameraData camData(&camera);
 
-    FeatureDetector featDetector(params.fDecType);
-    DescriptorMatcher descMatcher(params.fMatchType, params.fKnnRatio, params.bDebugMatE, params.winSize);
+    FeatureDetector featDetector(params.fDecType, params.fTileGrid, params.fTileKPts);
+    DescriptorMatcher descMatcher(params.fMatchType, params.fKnnRatio, isMatchVisEnabled, params.winSize);
     
     cv::TermCriteria flowTermCrit(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, params.ofMaxItCt, params.ofItEps);
-    OptFlow optFlow(flowTermCrit, params.ofWinSize, params.ofMaxLevel, params.ofMaxError, params.ofMaxCorn, params.ofQualLvl, params.ofMinDist, params.ofMinKPts);
+    OptFlow optFlow(flowTermCrit, params.ofWinSize, params.ofMaxLevel, params.ofMaxError, params.ofMaxCorn, params.ofQualLvl, params.ofMinDist, params.ofMinKPts, params.ofNumThr, params.ofGridSize, params.ofCellCorn);
 
     RecoveryPose recPose(params.peMethod, params.peProb, params.peThresh, params.peMinInl, params.pePMetrod, params.peExGuess, params.peNumIteR);
 
-    ViewDataContainer viewContainer(params.bDebugMatE ? INT32_MAX : 100);
+    ViewDataContainer viewContainer(100);
 
     FeatureView featPrevView, featCurrView;
     FlowView ofPrevView, ofCurrView; 
+    FlowTracks flowTracks;
 
-    Reconstruction reconstruction(params.tMethod, params.baMethod, params.baMaxRMSE, params.tMinDist, params.tMaxDist, params.tMaxPErr, true);
+    Reconstruction reconstruction(params.baMethod, params.baMaxRMSE, params.tMinDist, params.tMaxDist, params.tMaxPErr, true);
 
     PointCloud pointCloud(params.cSRemThr); 
     Tracking tracking(&pointCloud);
@@ -126,26 +155,119 @@ void AppSolver::run() {
 
     WindowInputDataParams mouseUsrDataParams(&m_isUpdating, &userInput);
     
-    // run windows in new thread -> avoid rendering white screen
-    cv::startWindowThread();
+    if (isVisEnabled) {
+        // run windows in new thread -> avoid rendering white screen
+        cv::startWindowThread();
 
-    cv::namedWindow(params.usrInpWinName, cv::WINDOW_NORMAL);
-    cv::namedWindow(params.recPoseWinName, cv::WINDOW_NORMAL);
-    
-    cv::resizeWindow(params.usrInpWinName, params.winSize);
-    cv::resizeWindow(params.recPoseWinName, params.winSize);
+        cv::namedWindow(params.usrInpWinName, cv::WINDOW_NORMAL);
+        cv::namedWindow(params.recPoseWinName, cv::WINDOW_NORMAL);
+        
+        cv::resizeWindow(params.usrInpWinName, params.winSize);
+        cv::resizeWindow(params.recPoseWinName, params.winSize);
 
-    if (params.bDebugMatE) {
-        cv::namedWindow(params.matchesWinName, cv::WINDOW_NORMAL);
-        cv::resizeWindow(params.matchesWinName, params.winSize);
-    }
+        if (isMatchVisEnabled) {
+            cv::namedWindow(params.matchesWinName, cv::WINDOW_NORMAL);
+            cv::resizeWindow(params.matchesWinName, params.winSize);
+        }
 
-    cv::setMouseCallback(params.usrInpWinName, onUsrWinClick, (void*)&mouseUsrDataParams);
+        cv::setMouseCallback(params.usrInpWinName, onUsrWinClick, (void*)&mouseUsrDataParams);
+    }
 
     // initialize visualization windows VTK, PCL
-    VisPCL visPCL(params.ptCloudWinName + " PCL", params.winSize);
+    VisPCL visPCL(params.ptCloudWinName + " PCL", params.winSize, cv::viz::Color::black(), params.bDebugVisE && isVisEnabled);
 
     //VisVTK visVTK(params.ptCloudWinName + " VTK", params.winSize);
+
+    // PnP pipeline -> accepted image is registered in the next iteration, while features of the next accepted image are extracted
+    FeatureView featNextView;
+    std::future<void> featFuture;
+
+    bool isViewPending = false;
+
+    // state of pending image from its acceptance
+    cv::Matx33d pendingR; cv::Matx31d pendingT;
+    std::vector<cv::Point2f> pendingClickedPts, pendingMovedPts;
+
+    // match pending image with previous one, recover its pose and triangulate matches with the last camera
+    const auto registerPendingView = [&]() {
+        if (featPrevView.keyPts.empty() || featCurrView.keyPts.empty()) { 
+            std::cerr << "None keypoints to match, skip matching/triangulation!\n";
+
+            return; 
+        }
+
+        std::vector<cv::Point2f> _prevPts, _currPts;
+        std::vector<cv::DMatch> _matches;
+        std::vector<int> _prevIdx, _currIdx;
+
+        // match features
+        descMatcher.findRobustMatches(featPrevView.keyPts, featCurrView.keyPts, featPrevView.descriptor, featCurrView.descriptor, _prevPts, _currPts, _matches, _prevIdx, _currIdx, featPrevView.viewPtr->imColor, featCurrView.viewPtr->imColor, true);
+
+        std::cout << "Matches count: " << _matches.size() << "\n";
+
+        if (_prevPts.empty() || _currPts.empty()) { 
+            std::cerr << "None points to triangulate, skip triangulation!\n";
+
+            return; 
+        }
+
+        // the first camera pose is from essential matrix
+        recPose.R = pendingR; recPose.t = pendingT;
+
+        TrackView _trackView;
+
+        bool isPoseRecovered = tracking.trackViews.empty();
+
+        cv::Matx34d _predPose;
+
+        if (!isPoseRecovered && params.peGuidRad > 0 && camData.predictCamPose(_predPose))
+            isPoseRecovered = tracking.findGuidedCameraPose(params.fKnnRatio, params.peGuidRad, params.peGuidIter, params.peTMaxIter, camera, _predPose, featCurrView, recPose, _trackView, pointCloud);
+
+        if (!isPoseRecovered && params.peIdxMatch)
+            isPoseRecovered = tracking.findIndexedCameraPose(params.fKnnRatio, camera, featCurrView, recPose, _trackView, pointCloud);
+
+        if (!isPoseRecovered)
+            isPoseRecovered = Tracking::findRecoveredCameraPose(descMatcher, params.peMinMatch, params.peTMaxIter, camera, featCurrView, recPose, tracking.trackViews, _trackView, pointCloud);
+
+        if (!isPoseRecovered) {
+            std::cout << "Recovering camera fail, skip current reconstruction iteration!\n";
+
+            return;
+        }
+
+        std::vector<cv::Vec3d> _points3D, _usrPoints3D;
+        std::vector<cv::Vec3b> _pointsRGB, _usrPointsRGB;
+        std::vector<bool> _mask, _usrMask;
+
+        cv::Matx34d _prevPose, _currPose; 
+
+        // prepare previous and current camera poses for triangulation
+        // previous camera pose is last camera pose in scene, current is from camera estimation
+        if (camData.extrinsics.empty())
+            composeExtrinsicMat(cv::Matx33d::eye(), cv::Matx31d::eye(), _prevPose);
+        else
+            _prevPose = camData.extrinsics.back();
+
+        composeExtrinsicMat(recPose.R, recPose.t, _currPose);
+
+        // triangulate feature points and user clicked points
+        reconstruction.triangulateCloud(camera, _prevPts, _currPts, featCurrView.viewPtr->imColor, _points3D, _pointsRGB, _mask, _prevPose, _currPose, recPose.R, recPose.t);
+
+        // triangulate user clicked points
+        reconstruction.triangulateCloud(camera, pendingClickedPts, pendingMovedPts, featCurrView.viewPtr->imColor, _usrPoints3D, _usrPointsRGB, _usrMask, _prevPose, _currPose, recPose.R, recPose.t);
+
+        userInput.addPoints(pendingMovedPts, _usrPoints3D, tracking.getTrackViews().size());
+
+        // register tracks for PnP 2D-3D matching and point cloud
+        if (tracking.addTrackView(std::move(_trackView), _mask, _currPts, _points3D, _pointsRGB, featCurrView.keyPts, featCurrView.descriptor, _currIdx)) {
+            camData.addCamPose(_currPose);
+
+            if (isVisEnabled) {
+                //visVTK.addPoints(_usrPoints3D);
+                visPCL.addPoints(_usrPoints3D);
+            }
+        }
+    };
 #pragma endregion INIT
 
     for (uint iteration = 1; ; ++iteration) {
@@ -160,37 +282,44 @@ void AppSolver::run() {
             if (iteration != 1 && ofPrevView.corners.size() < optFlow.additionalSettings.minFeatures) {
                 ofPrevView.setView(viewContainer.getLastOneItem());
 
-                featDetector.generateFlowFeatures(ofPrevView.viewPtr->imGray, ofPrevView.corners, optFlow.additionalSettings.maxCorn, optFlow.additionalSettings.qualLvl, optFlow.additionalSettings.minDist);
+                featDetector.generateFlowFeatures(ofPrevView.viewPtr->imGray, ofPrevView.corners, optFlow.additionalSettings.maxCorn, optFlow.additionalSettings.qualLvl, optFlow.additionalSettings.minDist, optFlow.additionalSettings.gridSize, optFlow.additionalSettings.cellMaxCorn);
             }
 
-            if (findGoodImages(cap, viewContainer) == ImageFindState::SOURCE_LOST) 
+            if (findGoodImages(frameLoader, viewContainer) == ImageFindState::SOURCE_LOST) 
                 break;
             
             // prepare flow view images for flow computing and debug draw
             ofPrevView.setView(viewContainer.getLastButOneItem());
             ofCurrView.setView(viewContainer.getLastOneItem());
 
-            ofCurrView.viewPtr->imColor.copyTo(imOutRecPose);
-            ofCurrView.viewPtr->imColor.copyTo(imOutUsrInp);
+            if (isVisEnabled) {
+                ofCurrView.viewPtr->imColor.copyTo(imOutRecPose);
+                ofCurrView.viewPtr->imColor.copyTo(imOutUsrInp);
+            }
 
             userInput.lockClickedPoints();
 
             if (!ofPrevView.corners.empty()) {
-                userInput.attachPointsToMove(ofPrevView.corners, ofCurrView.corners, optFlow.statusMask, true, true);
+                flowTracks.setPoints(ofPrevView.corners);
+
+                userInput.attachPointsToMove(flowTracks, true, true);
 
                 // move user points and corners
-                optFlow.computeFlow(ofPrevView.viewPtr->imGray, ofCurrView.viewPtr->imGray, ofPrevView.corners, ofCurrView.corners, optFlow.statusMask);
+                optFlow.computeFlow(ofPrevView.viewPtr, ofCurrView.viewPtr, flowTracks);
 
-                userInput.detachPointsFromMove(ofPrevView.corners, ofCurrView.corners, optFlow.statusMask, true, true);
+                userInput.detachPointsFromMove(flowTracks, true, true);
 
-                ProcesingAdds::filterPointsByStatusMask(ofPrevView.corners, ofCurrView.corners, optFlow.statusMask);
-                ProcesingAdds::filterPointsByBoundary(ofPrevView.corners, ofCurrView.corners, m_boundary);
+                ProcesingAdds::filterPointsByStatusMask(flowTracks);
+                ProcesingAdds::filterPointsByBoundary(flowTracks, m_boundary);
+
+                flowTracks.releasePoints(ofPrevView.corners, ofCurrView.corners);
 
                 PointsMove pointsMove; ProcesingAdds::analyzePointsMove(ofPrevView.corners, ofCurrView.corners, pointsMove);
                 ProcesingAdds::correctPointsByMoveAnalyze(userInput.doneClickedPts, userInput.moveClickedPts, pointsMove);
                 ProcesingAdds::correctPointsByMoveAnalyze(userInput.doneUsrPts, userInput.moveUsrPts, pointsMove);
 
-                optFlow.drawOpticalFlow(imOutRecPose, imOutRecPose, ofPrevView.corners, ofCurrView.corners, optFlow.statusMask);
+                if (isVisEnabled)
+                    optFlow.drawOpticalFlow(imOutRecPose, imOutRecPose, ofPrevView.corners, ofCurrView.corners, flowTracks.statusMask);
             }
 
             std::swap(userInput.moveUsrPts, userInput.doneUsrPts);
@@ -204,11 +333,13 @@ void AppSolver::run() {
             userInput.updateWaitingPoints();
             userInput.unlockClickedPoints();
 
-            // draw moved points
-            userInput.recoverPoints(imOutUsrInp);
+            if (isVisEnabled) {
+                // draw moved points
+                userInput.recoverPoints(imOutUsrInp);
 
-            cv::imshow(params.recPoseWinName, imOutRecPose);
-            cv::imshow(params.usrInpWinName, imOutUsrInp);
+                cv::imshow(params.recPoseWinName, imOutRecPose);
+                cv::imshow(params.usrInpWinName, imOutUsrInp);
+            }
 
             // prepare views to load new frame
             std::swap(ofPrevView, ofCurrView);
@@ -224,11 +355,11 @@ void AppSolver::run() {
             if (iteration != 1 && ofPrevView.corners.size() < optFlow.additionalSettings.minFeatures) {
                 ofPrevView.setView(viewContainer.getLastOneItem());
 
-                featDetector.generateFlowFeatures(ofPrevView.viewPtr->imGray, ofPrevView.corners, optFlow.additionalSettings.maxCorn, optFlow.additionalSettings.qualLvl, optFlow.additionalSettings.minDist);
+                featDetector.generateFlowFeatures(ofPrevView.viewPtr->imGray, ofPrevView.corners, optFlow.additionalSettings.maxCorn, optFlow.additionalSettings.qualLvl, optFlow.additionalSettings.minDist, optFlow.additionalSettings.gridSize, optFlow.additionalSettings.cellMaxCorn);
             }
 
             // find good image pair by optical flow and essential matrix
-            ImageFindState state = (ImageFindState)findGoodImages(cap, viewContainer, featDetector, optFlow, camera,recPose, ofPrevView, ofCurrView);
+            ImageFindState state = (ImageFindState)findGoodImages(frameLoader, viewContainer, featDetector, optFlow, camera,recPose, ofPrevView, ofCurrView);
             
             if (state == ImageFindState::SOURCE_LOST) { break; }
             if (state == ImageFindState::NOT_FOUND) {
@@ -246,27 +377,34 @@ void AppSolver::run() {
             ofPrevView.setView(viewContainer.getLastButOneItem());
             ofCurrView.setView(viewContainer.getLastOneItem());
 
-            ofCurrView.viewPtr->imColor.copyTo(imOutRecPose);
-            ofCurrView.viewPtr->imColor.copyTo(imOutUsrInp);
+            if (isVisEnabled) {
+                ofCurrView.viewPtr->imColor.copyTo(imOutRecPose);
+                ofCurrView.viewPtr->imColor.copyTo(imOutUsrInp);
 
-            recPose.drawRecoveredPose(imOutRecPose, imOutRecPose, ofPrevView.corners, ofCurrView.corners, recPose.mask);
+                recPose.drawRecoveredPose(imOutRecPose, imOutRecPose, ofPrevView.corners, ofCurrView.corners, recPose.mask);
 
-            cv::imshow(params.recPoseWinName, imOutRecPose);
+                cv::imshow(params.recPoseWinName, imOutRecPose);
+            }
 
             userInput.lockClickedPoints();
 
             if (!ofPrevView.corners.empty()) {
-                userInput.attachPointsToMove(ofPrevView.corners, ofCurrView.corners, optFlow.statusMask, true, false);
+                flowTracks.setPoints(ofPrevView.corners);
+
+                userInput.attachPointsToMove(flowTracks, true, false);
 
                 // move user points and corners
-                optFlow.computeFlow(ofPrevView.viewPtr->imGray, ofCurrView.viewPtr->imGray, ofPrevView.corners, ofCurrView.corners, optFlow.statusMask);
+                optFlow.computeFlow(ofPrevView.viewPtr, ofCurrView.viewPtr, flowTracks);
+
+                userInput.detachPointsFromMove(flowTracks, true, false);
 
-                userInput.detachPointsFromMove(ofPrevView.corners, ofCurrView.corners, optFlow.statusMask, true, false);
+                flowTracks.releasePoints(ofPrevView.corners, ofCurrView.corners);
 
                 PointsMove pointsMove; ProcesingAdds::analyzePointsMove(ofPrevView.corners, ofCurrView.corners, pointsMove);
                 ProcesingAdds::correctPointsByMoveAnalyze(userInput.doneClickedPts, userInput.moveClickedPts, pointsMove);
 
-                optFlow.drawOpticalFlow(imOutRecPose, imOutRecPose, ofPrevView.corners, ofCurrView.corners, optFlow.statusMask);
+                if (isVisEnabled)
+                    optFlow.drawOpticalFlow(imOutRecPose, imOutRecPose, ofPrevView.corners, ofCurrView.corners, flowTracks.statusMask);
             }
 
             std::vector<cv::Vec3d> _points3D, _usrPoints3D;
@@ -296,13 +434,17 @@ void AppSolver::run() {
             userInput.updateWaitingPoints();
             userInput.unlockClickedPoints();
 
+            userInput.keepCloudPoints();
+
             // draw moved points
-            userInput.recoverPoints(imOutUsrInp, camera.K, cv::Mat(camData.actualR), cv::Mat(camData.actualT));
+            if (isVisEnabled)
+                userInput.recoverPoints(imOutUsrInp, camera.K, cv::Mat(camData.actualR), cv::Mat(camData.actualT));
         
             //visPCL.addCamera(camData.extrinsics.back() , camera.K);
             //visPCL.addPoints(_usrPoints3D);
 
-            cv::imshow(params.usrInpWinName, imOutUsrInp);
+            if (isVisEnabled)
+                cv::imshow(params.usrInpWinName, imOutUsrInp);
 
             // prepare views to load new frame
             std::swap(ofPrevView, ofCurrView);
@@ -313,167 +455,175 @@ void AppSolver::run() {
 #pragma region Perspective-n-Point
 
         if (m_usedMethod == Method::PNP) {
-            if (iteration != 1) {
-                // do bundle adjust after loop iteration to avoid "continue" statement
-                if (params.baProcIt != 0 && (iteration % params.baProcIt == 1 || params.baProcIt == 1)) {
-                    reconstruction.adjustBundle(camData, pointCloud);
-                }
-
-                // do filteration after loop iteration to avoid "continue" statement
-                if (params.cFProcIt != 0 && (iteration % params.cFProcIt == 1 || params.cFProcIt == 1)) {
-                    pointCloud.filterCloud();
-                }
-
-                if (ofPrevView.corners.size() < optFlow.additionalSettings.minFeatures) {
-                    ofPrevView.setView(viewContainer.getLastOneItem());
+            if (iteration != 1 && ofPrevView.corners.size() < optFlow.additionalSettings.minFeatures) {
+                ofPrevView.setView(viewContainer.getLastOneItem());
 
-                    featDetector.generateFlowFeatures(ofPrevView.viewPtr->imGray, ofPrevView.corners, optFlow.additionalSettings.maxCorn, optFlow.additionalSettings.qualLvl, optFlow.additionalSettings.minDist);
-                }
+                featDetector.generateFlowFeatures(ofPrevView.viewPtr->imGray, ofPrevView.corners, optFlow.additionalSettings.maxCorn, optFlow.additionalSettings.qualLvl, optFlow.additionalSettings.minDist, optFlow.additionalSettings.gridSize, optFlow.additionalSettings.cellMaxCorn);
             }
 
             // find good image pair by optical flow and essential matrix
-            ImageFindState state = (ImageFindState)findGoodImages(cap, viewContainer, featDetector, optFlow, camera,recPose, ofPrevView, ofCurrView);
-            
-            if (state == ImageFindState::SOURCE_LOST) { break; }
-            if (state == ImageFindState::NOT_FOUND) {
-                ofPrevView.corners.clear();
-                ofCurrView.corners.clear();
+            ImageFindState state = (ImageFindState)findGoodImages(frameLoader, viewContainer, featDetector, optFlow, camera,recPose, ofPrevView, ofCurrView);
 
-                std::swap(featPrevView, featCurrView);
+            // essential matrix pose is kept for registration in the next iteration
+            const cv::Matx33d _acceptedR = recPose.R; const cv::Matx31d _acceptedT = recPose.t;
 
-                std::cout << "Good images pair not found -> skipping current iteration!" << "\n";
+            // features of previous accepted image were extracted during this search
+            if (isViewPending) {
+                featFuture.get();
 
-                continue;
+                std::swap(featCurrView, featNextView);
             }
 
-            // prepare flow view images for debug draw
-            ofPrevView.setView(viewContainer.getLastButOneItem());
-            ofCurrView.setView(viewContainer.getLastOneItem());
+            // extract features of accepted image in background -> overlaps with registration of previous accepted image and bundle adjustment
+            // detector is used only by this task until the next iteration
+            if (state == ImageFindState::FOUND) {
+                const bool isPrevMissing = !isViewPending && featPrevView.keyPts.empty();
 
-            ofCurrView.viewPtr->imColor.copyTo(imOutRecPose);
-            ofCurrView.viewPtr->imColor.copyTo(imOutUsrInp);
+                if (isPrevMissing)
+                    featPrevView.setView(viewContainer.getLastButOneItem());
 
-            recPose.drawRecoveredPose(imOutRecPose, imOutRecPose, ofPrevView.corners, ofCurrView.corners, recPose.mask);
+                featNextView.setView(viewContainer.getLastOneItem());
 
-            cv::imshow(params.recPoseWinName, imOutRecPose);
-
-            userInput.lockClickedPoints();
+                featFuture = std::async(std::launch::async, [&featDetector, &featPrevView, &featNextView, isPrevMissing]() {
+                    if (isPrevMissing)
+                        featDetector.generateFeatures(featPrevView.viewPtr->imGray, featPrevView.keyPts, featPrevView.descriptor);
 
-            if (!ofPrevView.corners.empty()) {
-                userInput.attachPointsToMove(ofPrevView.corners, ofCurrView.corners, optFlow.statusMask, true, false);
+                    featDetector.generateFeatures(featNextView.viewPtr->imGray, featNextView.keyPts, featNextView.descriptor);
+                });
+            }
 
-                // move user points and corners
-                optFlow.computeFlow(ofPrevView.viewPtr->imGray, ofCurrView.viewPtr->imGray, ofPrevView.corners, ofCurrView.corners, optFlow.statusMask);
+            if (isViewPending) {
+                registerPendingView();
 
-                userInput.detachPointsFromMove(ofPrevView.corners, ofCurrView.corners, optFlow.statusMask, true, false);
+                // image with features is matched with next one even if its registration failed
+                if (!featCurrView.keyPts.empty())
+                    std::swap(featPrevView, featCurrView);
 
-                PointsMove pointsMove; ProcesingAdds::analyzePointsMove(ofPrevView.corners, ofCurrView.corners, pointsMove);
-                ProcesingAdds::correctPointsByMoveAnalyze(userInput.doneClickedPts, userInput.moveClickedPts, pointsMove);
-
-                optFlow.drawOpticalFlow(imOutRecPose, imOutRecPose, ofPrevView.corners, ofCurrView.corners, optFlow.statusMask);
+                isViewPending = false;
             }
 
-            std::vector<cv::Vec3d> _points3D, _usrPoints3D;
-            std::vector<cv::Vec3b> _pointsRGB, _usrPointsRGB;
-            std::vector<bool> _mask, _usrMask;
+            if (state == ImageFindState::SOURCE_LOST) { break; }
 
-            cv::Matx34d _prevPose, _currPose; 
+            if (iteration != 1) {
+                // merge finished background bundle adjustment -> cameras and points added meanwhile are kept
+                reconstruction.mergeBundle(camData, pointCloud);
 
-            // prepare feature view images for generate features
-            featPrevView.setView(viewContainer.getLastButOneItem());
-            featCurrView.setView(viewContainer.getLastOneItem());
+                // do bundle adjust after loop iteration to avoid "continue" statement
+                // full adjustment is rarer pass, local window otherwise
+                const bool isFullBA = params.baFullIt != 0 && (iteration % params.baFullIt == 1 || params.baFullIt == 1);
+
+                if (isFullBA || (params.baProcIt != 0 && (iteration % params.baProcIt == 1 || params.baProcIt == 1))) {
+                    if (reconstruction.isBundleAdjusting()) {
+                        std::cout << "Bundle adjustment is still running -> skipping process" << "\n";
+                    } else {
+                        // better initial structure from all observations
+                        if (params.tMinViews > 0)
+                            reconstruction.retriangulateCloud(camData, pointCloud, params.tMinViews, isFullBA ? 0 : params.baWinSize);
+
+                        if (params.baAsync)
+                            reconstruction.adjustBundleAsync(camData, pointCloud, isFullBA ? 0 : params.baWinSize);
+                        else
+                            reconstruction.adjustBundle(camData, pointCloud, isFullBA ? 0 : params.baWinSize);
+                    }
+                }
 
-            if (featPrevView.keyPts.empty()) {
-                featDetector.generateFeatures(featPrevView.viewPtr->imGray, featPrevView.keyPts, featPrevView.descriptor);
+                // do filteration after loop iteration to avoid "continue" statement
+                if (params.cFProcIt != 0 && (iteration % params.cFProcIt == 1 || params.cFProcIt == 1)) {
+                    pointCloud.filterCloud();
+                }
             }
 
-            // prepare features
-            featDetector.generateFeatures(featCurrView.viewPtr->imGray, featCurrView.keyPts, featCurrView.descriptor);
+            if (state == ImageFindState::NOT_FOUND) {
+                ofPrevView.corners.clear();
+                ofCurrView.corners.clear();
 
-            if (featPrevView.keyPts.empty() || featCurrView.keyPts.empty()) { 
-                std::cerr << "None keypoints to match, skip matching/triangulation!\n";
+                std::cout << "Good images pair not found -> skipping current iteration!" << "\n";
 
-                continue; 
+                continue;
             }
 
-            std::vector<cv::Point2f> _prevPts, _currPts;
-            std::vector<cv::DMatch> _matches;
-            std::vector<int> _prevIdx, _currIdx;
-
-            // match features
-            descMatcher.findRobustMatches(featPrevView.keyPts, featCurrView.keyPts, featPrevView.descriptor, featCurrView.descriptor, _prevPts, _currPts, _matches, _prevIdx, _currIdx, featPrevView.viewPtr->imColor, featCurrView.viewPtr->imColor, true);
+            // prepare flow view images for debug draw
+            ofPrevView.setView(viewContainer.getLastButOneItem());
+            ofCurrView.setView(viewContainer.getLastOneItem());
 
-            std::cout << "Matches count: " << _matches.size() << "\n";
+            if (isVisEnabled) {
+                ofCurrView.viewPtr->imColor.copyTo(imOutRecPose);
+                ofCurrView.viewPtr->imColor.copyTo(imOutUsrInp);
 
-            if (_prevPts.empty() || _currPts.empty()) { 
-                std::cerr << "None points to triangulate, skip triangulation!\n";
+                recPose.drawRecoveredPose(imOutRecPose, imOutRecPose, ofPrevView.corners, ofCurrView.corners, recPose.mask);
 
-                continue; 
+                cv::imshow(params.recPoseWinName, imOutRecPose);
             }
 
-            TrackView _trackView;
-
-            if(!tracking.trackViews.empty() && !Tracking::findRecoveredCameraPose(descMatcher, params.peMinMatch, params.peTMaxIter, camera, featCurrView, recPose, tracking.trackViews, _trackView, pointCloud)) {
-                std::cout << "Recovering camera fail, skip current reconstruction iteration!\n";
-    
-                std::swap(ofPrevView, ofCurrView);
-                std::swap(featPrevView, featCurrView);
+            userInput.lockClickedPoints();
 
-                continue;
-            }
+            if (!ofPrevView.corners.empty()) {
+                flowTracks.setPoints(ofPrevView.corners);
 
-            // prepare previous and current camera poses for triangulation
-            // previous camera pose is last camera pose in scene, current is from camera estimation
-            if (camData.extrinsics.empty())
-                composeExtrinsicMat(cv::Matx33d::eye(), cv::Matx31d::eye(), _prevPose);
-            else
-                _prevPose = camData.extrinsics.back();
-    
-            composeExtrinsicMat(recPose.R, recPose.t, _currPose);
+                userInput.attachPointsToMove(flowTracks, true, false);
 
-            // triangulate feature points and user clicked points
-            reconstruction.triangulateCloud(camera, _prevPts, _currPts, ofCurrView.viewPtr->imColor, _points3D, _pointsRGB, _mask, _prevPose, _currPose, recPose.R, recPose.t);
+                // move user points and corners
+                optFlow.computeFlow(ofPrevView.viewPtr, ofCurrView.viewPtr, flowTracks);
 
-            // triangulate user clicked points
-            reconstruction.triangulateCloud(camera, userInput.doneClickedPts, userInput.moveClickedPts, ofCurrView.viewPtr->imColor, _usrPoints3D, _usrPointsRGB, _usrMask, _prevPose, _currPose, recPose.R, recPose.t);
+                userInput.detachPointsFromMove(flowTracks, true, false);
 
-            userInput.addPoints(userInput.moveClickedPts, _usrPoints3D, tracking.getTrackViews().size());
+                flowTracks.releasePoints(ofPrevView.corners, ofCurrView.corners);
 
-            // register tracks for PnP 2D-3D matching and point cloud
-            if (tracking.addTrackView(featCurrView.viewPtr, _trackView, _mask, _currPts, _points3D, _pointsRGB, featCurrView.keyPts, featCurrView.descriptor, _currIdx)) {
-                camData.addCamPose(_currPose);
+                PointsMove pointsMove; ProcesingAdds::analyzePointsMove(ofPrevView.corners, ofCurrView.corners, pointsMove);
+                ProcesingAdds::correctPointsByMoveAnalyze(userInput.doneClickedPts, userInput.moveClickedPts, pointsMove);
 
-                //visVTK.addPoints(_usrPoints3D);
-                visPCL.addPoints(_usrPoints3D);
+                if (isVisEnabled)
+                    optFlow.drawOpticalFlow(imOutRecPose, imOutRecPose, ofPrevView.corners, ofCurrView.corners, flowTracks.statusMask);
             }
 
+            // accepted image is registered in the next iteration with clicked points moved to it
+            std::swap(pendingClickedPts, userInput.doneClickedPts);
+            std::swap(pendingMovedPts, userInput.moveClickedPts);
+
+            pendingR = _acceptedR; pendingT = _acceptedT;
+
+            isViewPending = true;
+
             userInput.clearClickedPoints();
             userInput.updateWaitingPoints();
             userInput.unlockClickedPoints();
 
-            // draw moved points
-            userInput.recoverPoints(imOutUsrInp, camera.K, cv::Mat(camData.actualR), cv::Mat(camData.actualT));
+            userInput.keepCloudPoints();
+
+            if (isVisEnabled) {
+                // draw moved points
+                userInput.recoverPoints(imOutUsrInp, camera.K, cv::Mat(camData.actualR), cv::Mat(camData.actualT));
 
-            //visVTK.updatePointCloud(pointCloud.cloud3D, pointCloud.cloudRGB, pointCloud.cloudMask);
-            visPCL.updatePointCloud(pointCloud.cloud3D, pointCloud.cloudRGB, pointCloud.cloudMask);
+                //visVTK.updatePointCloud(pointCloud.cloud3D, pointCloud.cloudRGB, pointCloud.cloudMask);
+                visPCL.updatePointCloud(pointCloud.cloud3D, pointCloud.cloudRGB, pointCloud.cloudMask);
 
-            //visVTK.updateCameras(camData.extrinsics, camera.K);
-            visPCL.updateCameras(camData.extrinsics);
-            //visVTK.visualize(params.ptCloudWinName + " VTK", params.winSize, cv::viz::Color::black());
+                //visVTK.updateCameras(camData.extrinsics, camera.K);
+                visPCL.updateCameras(camData.extrinsics);
+                //visVTK.visualize(params.ptCloudWinName + " VTK", params.winSize, cv::viz::Color::black());
 
-            cv::imshow(params.usrInpWinName, imOutUsrInp);
+                cv::imshow(params.usrInpWinName, imOutUsrInp);
+            }
 
             std::swap(ofPrevView, ofCurrView);
-            std::swap(featPrevView, featCurrView);
         }
 
 #pragma endregion Perspective-n-Point
 
-        wri.write(imOutUsrInp);
+        std::cout << "Iteration: " << iteration << "\n"; 
+        
+        if (isVisEnabled) {
+            wri->write(imOutUsrInp);
 
-        std::cout << "Iteration: " << iteration << "\n"; cv::waitKey(29);
+            cv::waitKey(29);
+        }
     }
 
+    // finish running background bundle adjustment
+    reconstruction.mergeBundle(camData, pointCloud, true);
+
+    frameLoader.stop();
+
     cap.release();
-    wri.stop();
+
+    if (wri) { wri->stop(); }
 }
\ No newline at end of file
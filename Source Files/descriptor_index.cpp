@@ -0,0 +1,212 @@
+#include "descriptor_index.h"
+
+#include <random>
+#include <numeric>
+
+/**
+ * Best and second best distance of distinct cloud points for one query
+ */
+struct IndexCandidate {
+    float bestDist, secondDist;
+    int bestRow;
+    size_t bestCloudIdx;
+
+    IndexCandidate()
+        : bestDist(FLT_MAX), secondDist(FLT_MAX), bestRow(-1), bestCloudIdx(SIZE_MAX) {}
+
+    void update(const float dist, const int row, const size_t cloudIdx) {
+        if (dist < bestDist) {
+            // the same cloud point seen from another view is not a competitor
+            if (cloudIdx != bestCloudIdx)
+                secondDist = bestDist;
+
+            bestDist = dist;
+            bestRow = row;
+            bestCloudIdx = cloudIdx;
+        } else if (cloudIdx != bestCloudIdx && dist < secondDist)
+            secondDist = dist;
+    }
+};
+
+uint DescriptorIndex::lshKey(const uchar* desc, const int table) const {
+    uint key = 0;
+
+    for (size_t i = 0; i < m_lshBits[table].size(); ++i) {
+        const int bit = m_lshBits[table][i];
+
+        key |= (uint)((desc[bit >> 3] >> (bit & 7)) & 1) << i;
+    }
+
+    return key;
+}
+
+void DescriptorIndex::addLSH(const int firstRow) {
+    for (int row = firstRow; row < m_descriptors.rows; ++row) {
+        const uchar* _desc = m_descriptors.ptr<uchar>(row);
+
+        for (int t = 0; t < LSH_NUM_TABLES; ++t)
+            m_lshBuckets[t][lshKey(_desc, t)].push_back(row);
+    }
+}
+
+void DescriptorIndex::findLSHCandidates(const uchar* desc, std::vector<int>& candidates) const {
+    candidates.clear();
+
+    for (int t = 0; t < LSH_NUM_TABLES; ++t) {
+        const uint key = lshKey(desc, t);
+
+        const std::vector<int>& _bucket = m_lshBuckets[t][key];
+        candidates.insert(candidates.end(), _bucket.begin(), _bucket.end());
+
+        // multi-probe -> neighbours in one bit distance
+        for (int i = 0; i < LSH_KEY_SIZE; ++i) {
+            const std::vector<int>& _probe = m_lshBuckets[t][key ^ (1u << i)];
+            candidates.insert(candidates.end(), _probe.begin(), _probe.end());
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+}
+
+void DescriptorIndex::updateKdIndex() {
+    const int numRows = m_descriptors.rows;
+
+    // rebuild by doubling -> amortized cost per added descriptor stays constant
+    if (numRows < KD_MIN_BUILD_ROWS || numRows < 2 * m_numKdIndexed) { return; }
+
+    m_kdData = m_descriptors.clone();
+    m_kdIndex.reset(new cv::flann::Index(m_kdData, cv::flann::KDTreeIndexParams(KD_NUM_TREES)));
+
+    m_numKdIndexed = numRows;
+}
+
+void DescriptorIndex::add(const cv::Mat& descriptor, const std::vector<size_t>& cloudIdxs) {
+    if (descriptor.empty()) { return; }
+
+    CV_Assert(descriptor.rows == cloudIdxs.size());
+
+    if (m_descType < 0) {
+        m_descType = descriptor.type();
+        m_descCols = descriptor.cols;
+
+        if (m_descType == CV_8U) {
+            // each table samples different bits of descriptor
+            std::mt19937 rng(LSH_NUM_TABLES * LSH_KEY_SIZE);
+
+            std::vector<int> _bits(m_descCols * 8);
+            std::iota(_bits.begin(), _bits.end(), 0);
+
+            for (int t = 0; t < LSH_NUM_TABLES; ++t) {
+                std::shuffle(_bits.begin(), _bits.end(), rng);
+
+                m_lshBits.push_back(std::vector<int>(_bits.begin(), _bits.begin() + std::min(LSH_KEY_SIZE, (int)_bits.size())));
+            }
+
+            m_lshBuckets.assign(LSH_NUM_TABLES, std::vector<std::vector<int>>(1u << LSH_KEY_SIZE));
+        }
+    }
+
+    CV_Assert(descriptor.type() == m_descType && descriptor.cols == m_descCols);
+
+    const int firstRow = m_descriptors.rows;
+
+    if (m_descType == CV_8U) {
+        cv::Mat _padded; HammingKnnMatcher::padRows(descriptor, _padded);
+
+        m_descriptors.push_back(_padded);
+
+        addLSH(firstRow);
+    } else {
+        cv::Mat _desc; descriptor.convertTo(_desc, CV_32F);
+
+        m_descriptors.push_back(_desc);
+    }
+
+    m_cloudIdxs.insert(m_cloudIdxs.end(), cloudIdxs.begin(), cloudIdxs.end());
+
+    if (m_descType != CV_8U)
+        updateKdIndex();
+}
+
+void DescriptorIndex::match(const cv::Mat& queryDesc, const float ratioThreshold, std::vector<cv::DMatch>& matches) {
+    matches.clear();
+
+    if (empty() || queryDesc.empty() || queryDesc.cols != m_descCols) { return; }
+
+    const int numQuery = queryDesc.rows;
+
+    std::vector<IndexCandidate> _candidates(numQuery);
+
+    if (m_descType == CV_8U) {
+        if (queryDesc.type() != CV_8U) { return; }
+
+        cv::Mat _query; HammingKnnMatcher::padRows(queryDesc, _query);
+
+        cv::parallel_for_(cv::Range(0, numQuery), [&](const cv::Range& range) {
+            std::vector<int> _rows, _dists;
+            std::vector<const uchar*> _rowPtrs;
+
+            for (int q = range.start; q < range.end; ++q) {
+                const uchar* _qDesc = _query.ptr<uchar>(q);
+
+                findLSHCandidates(_qDesc, _rows);
+
+                // all LSH candidates of the query by one kernel call
+                _rowPtrs.resize(_rows.size()); _dists.resize(_rows.size());
+                for (size_t r = 0; r < _rows.size(); ++r)
+                    _rowPtrs[r] = m_descriptors.ptr<uchar>(_rows[r]);
+
+                HammingKnnMatcher::distances(_qDesc, _rowPtrs.data(), (int)_rowPtrs.size(), _query.cols, _dists.data());
+
+                for (size_t r = 0; r < _rows.size(); ++r)
+                    _candidates[q].update((float)_dists[r], _rows[r], m_cloudIdxs[_rows[r]]);
+            }
+        });
+    } else {
+        cv::Mat _query; queryDesc.convertTo(_query, CV_32F);
+
+        if (m_kdIndex) {
+            const int numNeighbours = std::min(KD_NUM_NEIGHBOURS, m_numKdIndexed);
+
+            cv::Mat _indices, _dists;
+            m_kdIndex->knnSearch(_query, _indices, _dists, numNeighbours, cv::flann::SearchParams(KD_NUM_CHECKS));
+
+            for (int q = 0; q < numQuery; ++q) {
+                for (int k = 0; k < numNeighbours; ++k) {
+                    const int row = _indices.at<int>(q, k);
+
+                    // KD forest returns squared L2 distance
+                    if (row >= 0)
+                        _candidates[q].update(std::sqrt(_dists.at<float>(q, k)), row, m_cloudIdxs[row]);
+                }
+            }
+        }
+
+        // not indexed tail is searched by brute force
+        cv::parallel_for_(cv::Range(0, numQuery), [&](const cv::Range& range) {
+            for (int q = range.start; q < range.end; ++q) {
+                const float* _qDesc = _query.ptr<float>(q);
+
+                for (int row = m_numKdIndexed; row < m_descriptors.rows; ++row)
+                    _candidates[q].update(std::sqrt(cv::normL2Sqr<float, float>(_qDesc, m_descriptors.ptr<float>(row), m_descCols)), row, m_cloudIdxs[row]);
+            }
+        });
+    }
+
+    // ratio test and one query for each cloud point
+    std::unordered_map<size_t, size_t> _cloudToMatch;
+
+    for (int q = 0; q < numQuery; ++q) {
+        const IndexCandidate& c = _candidates[q];
+
+        if (c.bestRow < 0 || c.secondDist == FLT_MAX || c.bestDist >= ratioThreshold * c.secondDist) { continue; }
+
+        if (auto it = _cloudToMatch.find(c.bestCloudIdx); it == _cloudToMatch.end()) {
+            _cloudToMatch[c.bestCloudIdx] = matches.size();
+
+            matches.push_back(cv::DMatch(q, c.bestRow, c.bestDist));
+        } else if (c.bestDist < matches[it->second].distance)
+            matches[it->second] = cv::DMatch(q, c.bestRow, c.bestDist);
+    }
+}
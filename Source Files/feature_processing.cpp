@@ -1,6 +1,12 @@
 #include "feature_processing.h"
 
-FeatureDetector::FeatureDetector(std::string method) {
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAMMING_AVX2_KERNEL
+#endif
+
+FeatureDetector::FeatureDetector(std::string method, const int tileGrid, const int tileMaxKeyPts) 
+    : m_tileGrid(tileGrid), m_tileMaxKeyPts(tileMaxKeyPts) {
     std::for_each(method.begin(), method.end(), [](char& c){
         c = ::toupper(c);
     });
@@ -23,7 +29,20 @@ FeatureDetector::FeatureDetector(std::string method) {
     else
         m_detectorType = DetectorType::AKAZE;
 
-    switch (m_detectorType) {
+    createDetector(m_detectorType, detector, extractor);
+
+    // each tile has its own detector -> detectors are not shared between threads
+    if (m_tileGrid > 1) {
+        m_tileDetectors.resize(m_tileGrid * m_tileGrid);
+        m_tileExtractors.resize(m_tileGrid * m_tileGrid);
+
+        for (size_t i = 0; i < m_tileDetectors.size(); ++i)
+            createDetector(m_detectorType, m_tileDetectors[i], m_tileExtractors[i]);
+    }
+}
+
+void FeatureDetector::createDetector(DetectorType detectorType, cv::Ptr<cv::FeatureDetector>& detector, cv::Ptr<cv::FeatureDetector>& extractor) {
+    switch (detectorType) {
         case DetectorType::AKAZE: {
             //detector = extractor = cv::AKAZE::create(cv::AKAZE::DescriptorType::DESCRIPTOR_MLDB, 0, 3, 0.001f, 3, 3);
             detector = extractor = cv::AKAZE::create();
@@ -75,6 +94,12 @@ FeatureDetector::FeatureDetector(std::string method) {
 }
 
 void FeatureDetector::generateFeatures(cv::Mat& imGray, std::vector<cv::KeyPoint>& keyPts, cv::Mat& descriptor) {
+    if (m_tileGrid > 1) {
+        generateTileFeatures(imGray, keyPts, descriptor);
+
+        return;
+    }
+
     //  detectAndCompute is faster than detect/compute
     //  use detectAndCompute if same detector and extractor
     if (detector != extractor){
@@ -84,11 +109,92 @@ void FeatureDetector::generateFeatures(cv::Mat& imGray, std::vector<cv::KeyPoint
         detector->detectAndCompute(imGray, cv::noArray(), keyPts, descriptor);
 }
 
-void FeatureDetector::generateFlowFeatures(cv::Mat& imGray, std::vector<cv::Point2f>& corners, int maxCorners, double qualityLevel, double minDistance) {
+void FeatureDetector::generateTileFeatures(cv::Mat& imGray, std::vector<cv::KeyPoint>& keyPts, cv::Mat& descriptor) {
+    const cv::Size tileSize((imGray.cols + m_tileGrid - 1) / m_tileGrid, (imGray.rows + m_tileGrid - 1) / m_tileGrid);
+    const cv::Rect imBoundary(cv::Point(), imGray.size());
+
+    const int numTiles = m_tileGrid * m_tileGrid;
+
+    std::vector<std::vector<cv::KeyPoint>> _tileKeyPts(numTiles);
+    std::vector<cv::Mat> _tileDesc(numTiles);
+
+    cv::parallel_for_(cv::Range(0, numTiles), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i) {
+            // keypoints are owned by tile core, overlap only gives support to detector and descriptor
+            const cv::Rect _core = cv::Rect(cv::Point((i % m_tileGrid) * tileSize.width, (i / m_tileGrid) * tileSize.height), tileSize) & imBoundary;
+
+            if (_core.empty()) { continue; }
+
+            const cv::Rect _roi = cv::Rect(_core.x - TILE_OVERLAP, _core.y - TILE_OVERLAP, _core.width + 2 * TILE_OVERLAP, _core.height + 2 * TILE_OVERLAP) & imBoundary;
+
+            const cv::Mat _imTile = imGray(_roi);
+
+            std::vector<cv::KeyPoint> _keyPts; cv::Mat _desc;
+
+            if (m_tileDetectors[i] != m_tileExtractors[i]) {
+                m_tileDetectors[i]->detect(_imTile, _keyPts);
+                m_tileExtractors[i]->compute(_imTile, _keyPts, _desc);
+            } else
+                m_tileDetectors[i]->detectAndCompute(_imTile, cv::noArray(), _keyPts, _desc);
+
+            // move to image coordinates and keep only owned keypoints -> no duplicates across tile borders
+            std::vector<int> _owned;
+
+            for (size_t k = 0; k < _keyPts.size(); ++k) {
+                _keyPts[k].pt.x += _roi.x;
+                _keyPts[k].pt.y += _roi.y;
+
+                if (_core.contains(_keyPts[k].pt))
+                    _owned.push_back(k);
+            }
+
+            // per tile budget -> the strongest responses
+            if (m_tileMaxKeyPts > 0 && (int)_owned.size() > m_tileMaxKeyPts) {
+                std::nth_element(_owned.begin(), _owned.begin() + m_tileMaxKeyPts, _owned.end(), [&_keyPts](const int a, const int b) {
+                    return _keyPts[a].response > _keyPts[b].response;
+                });
+
+                _owned.resize(m_tileMaxKeyPts);
+
+                std::sort(_owned.begin(), _owned.end());
+            }
+
+            _tileKeyPts[i].reserve(_owned.size());
+            _tileDesc[i].create(_owned.size(), _desc.cols, _desc.type());
+
+            for (size_t k = 0; k < _owned.size(); ++k) {
+                _tileKeyPts[i].push_back(_keyPts[_owned[k]]);
+
+                _desc.row(_owned[k]).copyTo(_tileDesc[i].row(k));
+            }
+        }
+    });
+
+    // merge in tile order
+    keyPts.clear();
+    descriptor.release();
+
+    for (int i = 0; i < numTiles; ++i) {
+        if (_tileKeyPts[i].empty()) { continue; }
+
+        keyPts.insert(keyPts.end(), _tileKeyPts[i].begin(), _tileKeyPts[i].end());
+        descriptor.push_back(_tileDesc[i]);
+    }
+}
+
+void FeatureDetector::generateFlowFeatures(cv::Mat& imGray, std::vector<cv::Point2f>& corners, int maxCorners, double qualityLevel, double minDistance, int gridSize, int cellMaxCorners) {
     std::vector<cv::Point2f> _corners;
 
     std::cout << "Generating flow features..." << std::flush;
 
+    if (gridSize > 0 && cellMaxCorners > 0) {
+        generateGridFlowFeatures(imGray, corners, maxCorners, qualityLevel, minDistance, gridSize, cellMaxCorners);
+
+        std::cout << "[DONE]";
+
+        return;
+    }
+
     //  Use Shi-Tomasi corner detector
     cv::goodFeaturesToTrack(imGray, _corners, maxCorners, qualityLevel, minDistance);
 
@@ -98,6 +204,51 @@ void FeatureDetector::generateFlowFeatures(cv::Mat& imGray, std::vector<cv::Poin
     std::cout << "[DONE]";
 }
 
+void FeatureDetector::generateGridFlowFeatures(cv::Mat& imGray, std::vector<cv::Point2f>& corners, int maxCorners, double qualityLevel, double minDistance, int gridSize, int cellMaxCorners) {
+    const cv::Size cellSize((imGray.cols + gridSize - 1) / gridSize, (imGray.rows + gridSize - 1) / gridSize);
+    const cv::Rect imBoundary(cv::Point(), imGray.size());
+
+    // count live corners in each cell
+    std::vector<int> cellCorners(gridSize * gridSize, 0);
+
+    for (const auto& c : corners) {
+        const int cellX = std::min(std::max((int)c.x / cellSize.width, 0), gridSize - 1);
+        const int cellY = std::min(std::max((int)c.y / cellSize.height, 0), gridSize - 1);
+
+        cellCorners[cellY * gridSize + cellX]++;
+    }
+
+    // mask surroundings of live corners -> do not detect duplicate corners
+    cv::Mat mask(imGray.size(), CV_8U, cv::Scalar(255));
+
+    for (const auto& c : corners)
+        cv::circle(mask, c, std::max((int)minDistance, 1), cv::Scalar(0), cv::FILLED);
+
+    int numNewCorners = 0;
+
+    for (int cellY = 0; cellY < gridSize; ++cellY) {
+        for (int cellX = 0; cellX < gridSize && numNewCorners < maxCorners; ++cellX) {
+            const int cellBudget = std::min(cellMaxCorners - cellCorners[cellY * gridSize + cellX], maxCorners - numNewCorners);
+
+            if (cellBudget <= 0) { continue; }
+
+            const cv::Rect cell = cv::Rect(cv::Point(cellX * cellSize.width, cellY * cellSize.height), cellSize) & imBoundary;
+
+            if (cell.empty()) { continue; }
+
+            std::vector<cv::Point2f> _cellCorners;
+
+            //  Use Shi-Tomasi corner detector only inside of the cell
+            cv::goodFeaturesToTrack(imGray(cell), _cellCorners, cellBudget, qualityLevel, minDistance, mask(cell));
+
+            for (const auto& c : _cellCorners)
+                corners.push_back(c + cv::Point2f(cell.tl()));
+
+            numNewCorners += _cellCorners.size();
+        }
+    }
+}
+
 DescriptorMatcher::DescriptorMatcher(std::string method, const float ratioThreshold, const bool isVisDebug, const cv::Size visDebugWinSize)
     : m_ratioThreshold(ratioThreshold), m_isVisDebug(isVisDebug), m_visDebugWinSize(cv::Size(visDebugWinSize.width * 2, visDebugWinSize.height * 3)) {
 
@@ -105,7 +256,10 @@ DescriptorMatcher::DescriptorMatcher(std::string method, const float ratioThresh
         c = ::toupper(c);
     });
 
-    if (method == "BRUTEFORCE_HAMMING")
+    // popcount kernel for binary descriptors, OpenCV matcher is used for other descriptor types
+    m_useHammingKernel = method == "BRUTEFORCE_HAMMING_SIMD";
+
+    if (method == "BRUTEFORCE_HAMMING" || method == "BRUTEFORCE_HAMMING_SIMD")
         matcher = cv::DescriptorMatcher::create(cv::DescriptorMatcher::MatcherType::BRUTEFORCE_HAMMING);
     else if (method == "BRUTEFORCE_SL2")
         matcher = cv::DescriptorMatcher::create(cv::DescriptorMatcher::MatcherType::BRUTEFORCE_SL2);
@@ -116,6 +270,14 @@ DescriptorMatcher::DescriptorMatcher(std::string method, const float ratioThresh
 }
 
 void DescriptorMatcher::ratioMaches(const cv::Mat lDesc, const cv::Mat rDesc, std::vector<cv::DMatch>& matches) {
+    if (m_useHammingKernel && lDesc.type() == CV_8U && rDesc.type() == CV_8U) {
+        std::vector<cv::DMatch> _rMatches;
+
+        hammingRatioMatches(lDesc, rDesc, matches, _rMatches);
+
+        return;
+    }
+
     std::vector<std::vector<cv::DMatch>> knnMatches;
 
     matcher->knnMatch(lDesc, rDesc, knnMatches, 2);
@@ -129,7 +291,27 @@ void DescriptorMatcher::ratioMaches(const cv::Mat lDesc, const cv::Mat rDesc, st
     }
 }
 
-void DescriptorMatcher::drawMatches(const cv::Mat prevFrame, const cv::Mat currFrame, cv::Mat& outFrame, std::vector<cv::KeyPoint> prevKeyPts, std::vector<cv::KeyPoint> currKeyPts, std::vector<cv::DMatch> matches, const std::string matchType) {
+void DescriptorMatcher::hammingRatioMatches(const cv::Mat& lDesc, const cv::Mat& rDesc, std::vector<cv::DMatch>& lMatches, std::vector<cv::DMatch>& rMatches) {
+    std::vector<HammingKnnMatcher::KnnPair> _lKnn, _rKnn;
+
+    HammingKnnMatcher::knnMatch(lDesc, rDesc, _lKnn, _rKnn);
+
+    lMatches.clear();
+    rMatches.clear();
+
+    //  Match by knn the neighbor and the second best neighbor ratio
+    for (size_t i = 0; i < _lKnn.size(); ++i) {
+        if (_lKnn[i].bestIdx >= 0 && _lKnn[i].bestDist < m_ratioThreshold * (float)_lKnn[i].secondDist)
+            lMatches.push_back(cv::DMatch(i, _lKnn[i].bestIdx, (float)_lKnn[i].bestDist));
+    }
+
+    for (size_t i = 0; i < _rKnn.size(); ++i) {
+        if (_rKnn[i].bestIdx >= 0 && _rKnn[i].bestDist < m_ratioThreshold * (float)_rKnn[i].secondDist)
+            rMatches.push_back(cv::DMatch(i, _rKnn[i].bestIdx, (float)_rKnn[i].bestDist));
+    }
+}
+
+void DescriptorMatcher::drawMatches(const cv::Mat prevFrame, const cv::Mat currFrame, cv::Mat& outFrame, const std::vector<cv::KeyPoint>& prevKeyPts, const std::vector<cv::KeyPoint>& currKeyPts, const std::vector<cv::DMatch>& matches, const std::string matchType) {
     cv::drawMatches(prevFrame, prevKeyPts, currFrame, currKeyPts, matches, outFrame, CV_RGB(255,255,0));
 
     const std::string headedText = matchType;
@@ -141,72 +323,89 @@ void DescriptorMatcher::drawMatches(const cv::Mat prevFrame, const cv::Mat currF
     cv::putText(outFrame, matchesText, cv::Point(10,100), cv::FONT_HERSHEY_COMPLEX, 1.0, CV_RGB(255, 255, 255));
 }
 
-void DescriptorMatcher::findRobustMatches(std::vector<cv::KeyPoint> prevKeyPts, std::vector<cv::KeyPoint> currKeyPts, cv::Mat prevDesc, cv::Mat currDesc, std::vector<cv::Point2f>& prevAligPts, std::vector<cv::Point2f>& currAligPts, std::vector<cv::DMatch>& matches, std::vector<int>& prevPtsToKeyIdx, std::vector<int>& currPtsToKeyIdx, cv::Mat debugPrevFrame, cv::Mat debugCurrFrame, bool useEpipolarFilter) {
+void DescriptorMatcher::findRobustMatches(const std::vector<cv::KeyPoint>& prevKeyPts, const std::vector<cv::KeyPoint>& currKeyPts, const cv::Mat& prevDesc, const cv::Mat& currDesc, std::vector<cv::Point2f>& prevAligPts, std::vector<cv::Point2f>& currAligPts, std::vector<cv::DMatch>& matches, std::vector<int>& prevPtsToKeyIdx, std::vector<int>& currPtsToKeyIdx, cv::Mat debugPrevFrame, cv::Mat debugCurrFrame, bool useEpipolarFilter) {
     std::vector<cv::DMatch> fMatches, bMatches;
 
     // knn matches
-    ratioMaches(prevDesc, currDesc, fMatches);
-    ratioMaches(currDesc, prevDesc, bMatches);
+    if (m_useHammingKernel && prevDesc.type() == CV_8U && currDesc.type() == CV_8U)
+        hammingRatioMatches(prevDesc, currDesc, fMatches, bMatches);
+    else {
+        ratioMaches(prevDesc, currDesc, fMatches);
+        ratioMaches(currDesc, prevDesc, bMatches);
+    }
+
+    const bool isVisDebug = m_isVisDebug && (!debugPrevFrame.empty() && !debugCurrFrame.empty());
 
     cv::Mat _imKnnMatch, _imCrossMatching, _imEpipolarFilter, _imOutFilter;     
-    if (m_isVisDebug && (!debugPrevFrame.empty() && !debugCurrFrame.empty())) {
+    if (isVisDebug) {
         const std::string _matchHeader = "Knn Match";
 
         drawMatches(debugPrevFrame, debugCurrFrame, _imKnnMatch, prevKeyPts, currKeyPts, fMatches, _matchHeader);
     }
 
-    // crossmatching
-    for (const auto& bM : bMatches) {
-        bool isFound = false;
-
-        for (const auto& fM : fMatches) {
-            if (bM.queryIdx == fM.trainIdx && bM.trainIdx == fM.queryIdx) {
-                prevAligPts.push_back(prevKeyPts[fM.queryIdx].pt);
-                currAligPts.push_back(currKeyPts[fM.trainIdx].pt);
+    // crossmatching -> forward match of each prev keypoint is looked up by index
+    std::vector<int> _prevToFMatch(prevKeyPts.size(), -1);
 
-                matches.push_back(fM);
+    for (size_t m = 0; m < fMatches.size(); ++m)
+        _prevToFMatch[fMatches[m].queryIdx] = m;
 
-                isFound = true;
+    const size_t _firstMatchIdx = matches.size();
 
-                break;
-            }
-        }
+    for (const auto& bM : bMatches) {
+        const int _fMatchIdx = _prevToFMatch[bM.trainIdx];
 
-        if (isFound) { continue; }
+        if (_fMatchIdx >= 0 && fMatches[_fMatchIdx].trainIdx == bM.queryIdx)
+            matches.push_back(fMatches[_fMatchIdx]);
     }
 
-    if (m_isVisDebug && (!debugPrevFrame.empty() && !debugCurrFrame.empty())) {
+    if (isVisDebug) {
         const std::string _matchHeader = "CrossMatching";
 
         drawMatches(debugPrevFrame, debugCurrFrame, _imCrossMatching, prevKeyPts, currKeyPts, matches, _matchHeader);
     }
 
-    if (prevAligPts.empty() || currAligPts.empty()) { return; }
+    if (matches.size() == _firstMatchIdx) { return; }
+
+    // aligned points are gathered once from keypoint indices
+    const size_t _numCrossMatches = matches.size() - _firstMatchIdx;
+
+    prevAligPts.reserve(prevAligPts.size() + _numCrossMatches);
+    currAligPts.reserve(currAligPts.size() + _numCrossMatches);
+
+    for (size_t m = _firstMatchIdx; m < matches.size(); ++m) {
+        prevAligPts.push_back(prevKeyPts[matches[m].queryIdx].pt);
+        currAligPts.push_back(currKeyPts[matches[m].trainIdx].pt);
+    }
 
     // epipolar filter -> use fundamental mat
     std::vector<uint8_t> inliersMask(matches.size()); 
-    cv::findFundamentalMat(prevAligPts, currAligPts, inliersMask);
-    
-    std::vector<cv::DMatch> _epipolarMatch;
-    std::vector<cv::Point2f> _epipolarPrevPts, _epipolarCurrPts;
+    if (useEpipolarFilter)
+        cv::findFundamentalMat(prevAligPts, currAligPts, inliersMask);
+
+    // compact in place by fundamental mask
+    size_t _numInliers = 0;
 
     for (size_t m = 0; m < matches.size(); ++m) {
-        // filter by fundamental mask
         if (inliersMask[m] || !useEpipolarFilter) {
-            _epipolarPrevPts.push_back(prevKeyPts[matches[m].queryIdx].pt);
-            _epipolarCurrPts.push_back(currKeyPts[matches[m].trainIdx].pt);
+            matches[_numInliers] = matches[m];
+            prevAligPts[_numInliers] = prevAligPts[m];
+            currAligPts[_numInliers] = currAligPts[m];
 
             prevPtsToKeyIdx.push_back(matches[m].queryIdx);
             currPtsToKeyIdx.push_back(matches[m].trainIdx);
 
-            _epipolarMatch.push_back(matches[m]);
+            _numInliers++;
         }
     }
 
-    if (m_isVisDebug && (!debugPrevFrame.empty() && !debugCurrFrame.empty())) {
+    matches.resize(_numInliers);
+    prevAligPts.resize(_numInliers);
+    currAligPts.resize(_numInliers);
+
+    if (isVisDebug) {
         const std::string _matchHeader = "Epipolar filter";
 
-        drawMatches(debugPrevFrame, debugCurrFrame, _imEpipolarFilter, prevKeyPts, currKeyPts, _epipolarMatch, _matchHeader);
+        drawMatches(debugPrevFrame, debugCurrFrame, _imEpipolarFilter, prevKeyPts, currKeyPts, matches, _matchHeader);
 
         _imKnnMatch.copyTo(_imOutFilter);
         cv::vconcat(_imOutFilter, _imCrossMatching, _imOutFilter);
@@ -218,14 +417,188 @@ void DescriptorMatcher::findRobustMatches(std::vector<cv::KeyPoint> prevKeyPts,
 
         cv::waitKey(29);
     }
-    
-    //  update informations to output structures
-    std::swap(matches, _epipolarMatch);
-    std::swap(prevAligPts, _epipolarPrevPts);
-    std::swap(currAligPts, _epipolarCurrPts);
 }
 
-OptFlow::OptFlow(cv::TermCriteria termcrit, int winSize, int maxLevel, float maxError, uint maxCorners, float qualityLevel, float minCornersDistance, uint minFeatures) {
+static int hammingDistanceScalar(const uchar* a, const uchar* b, const int numBytes) {
+    int dist = 0;
+
+    for (int i = 0; i < numBytes; i += sizeof(uint64_t)) {
+        uint64_t wa, wb; 
+        std::memcpy(&wa, a + i, sizeof(uint64_t)); 
+        std::memcpy(&wb, b + i, sizeof(uint64_t));
+
+        dist += __builtin_popcountll(wa ^ wb);
+    }
+
+    return dist;
+}
+
+static void hammingRowsScalar(const uchar* a, const uchar* const* rows, const int numRows, const int numBytes, int* dists) {
+    for (int r = 0; r < numRows; ++r)
+        dists[r] = hammingDistanceScalar(a, rows[r], numBytes);
+}
+
+#if defined(HAMMING_AVX2_KERNEL)
+// only these kernels are compiled for AVX2 -> binary runs on CPUs without it
+// nibble lookup popcount by Wojciech Mula
+__attribute__((target("avx2")))
+static inline int hammingDistanceAVX2(const uchar* a, const uchar* b, const int numBytes, const __m256i lookup, const __m256i lowMask) {
+    __m256i acc = _mm256_setzero_si256();
+
+    for (int i = 0; i < numBytes; i += HammingKnnMatcher::BLOCK_BYTES) {
+        const __m256i v = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*)(a + i)), 
+            _mm256_loadu_si256((const __m256i*)(b + i))
+        );
+
+        const __m256i lo = _mm256_and_si256(v, lowMask);
+        const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+        const __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+    }
+
+    return (int)(_mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) + _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3));
+}
+
+__attribute__((target("avx2")))
+static __m256i hammingLookupAVX2() {
+    return _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+    );
+}
+
+__attribute__((target("avx2")))
+static int hammingDistanceAVX2(const uchar* a, const uchar* b, const int numBytes) {
+    return hammingDistanceAVX2(a, b, numBytes, hammingLookupAVX2(), _mm256_set1_epi8(0x0f));
+}
+
+// lookup and mask are set up once per row block
+__attribute__((target("avx2")))
+static void hammingRowsAVX2(const uchar* a, const uchar* const* rows, const int numRows, const int numBytes, int* dists) {
+    const __m256i lookup = hammingLookupAVX2();
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+
+    for (int r = 0; r < numRows; ++r)
+        dists[r] = hammingDistanceAVX2(a, rows[r], numBytes, lookup, lowMask);
+}
+#endif
+
+typedef int (*HammingDistanceKernel)(const uchar*, const uchar*, const int);
+typedef void (*HammingRowsKernel)(const uchar*, const uchar* const*, const int, const int, int*);
+
+static bool isAVX2Supported() {
+#if defined(HAMMING_AVX2_KERNEL)
+    __builtin_cpu_init();
+
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+// kernels are selected once by the running CPU
+static const bool s_isHammingAVX2 = isAVX2Supported();
+
+static HammingDistanceKernel selectDistanceKernel() {
+#if defined(HAMMING_AVX2_KERNEL)
+    if (s_isHammingAVX2) { return hammingDistanceAVX2; }
+#endif
+    return hammingDistanceScalar;
+}
+
+static HammingRowsKernel selectRowsKernel() {
+#if defined(HAMMING_AVX2_KERNEL)
+    if (s_isHammingAVX2) { return hammingRowsAVX2; }
+#endif
+    return hammingRowsScalar;
+}
+
+int HammingKnnMatcher::distance(const uchar* a, const uchar* b, const int numBytes) {
+    static const HammingDistanceKernel kernel = selectDistanceKernel();
+
+    return kernel(a, b, numBytes);
+}
+
+void HammingKnnMatcher::distances(const uchar* a, const uchar* const* rows, const int numRows, const int numBytes, int* dists) {
+    static const HammingRowsKernel kernel = selectRowsKernel();
+
+    kernel(a, rows, numRows, numBytes, dists);
+}
+
+void HammingKnnMatcher::padRows(const cv::Mat& desc, cv::Mat& paddedDesc) {
+    const int numBytes = ((desc.cols + BLOCK_BYTES - 1) / BLOCK_BYTES) * BLOCK_BYTES;
+
+    paddedDesc = cv::Mat::zeros(desc.rows, numBytes, CV_8U);
+
+    desc.copyTo(paddedDesc.colRange(0, desc.cols));
+}
+
+void HammingKnnMatcher::knnMatch(const cv::Mat& lDesc, const cv::Mat& rDesc, std::vector<KnnPair>& lKnn, std::vector<KnnPair>& rKnn) {
+    const int numL = lDesc.rows, numR = rDesc.rows;
+
+    lKnn.assign(numL, KnnPair());
+    rKnn.assign(numR, KnnPair());
+
+    if (numL == 0 || numR == 0) { return; }
+
+    CV_Assert(lDesc.type() == CV_8U && rDesc.type() == CV_8U && lDesc.cols == rDesc.cols);
+
+    cv::Mat _lDesc; padRows(lDesc, _lDesc);
+    cv::Mat _rDesc; padRows(rDesc, _rDesc);
+
+    const int numBytes = _lDesc.cols;
+
+    // tiles are small enough to keep right rows in cache while left rows are processed
+    const int tileRows = 64, tileCols = 256;
+    const int numTiles = (numL + tileRows - 1) / tileRows;
+
+    // each tile has its own right side candidates -> merged after parallel pass
+    std::vector<std::vector<KnnPair>> _tileRKnn(numTiles);
+
+    std::vector<const uchar*> _rRows(numR);
+    for (int j = 0; j < numR; ++j)
+        _rRows[j] = _rDesc.ptr<uchar>(j);
+
+    // kernel is selected once per match -> one call per left row and right tile
+    const HammingRowsKernel kernel = selectRowsKernel();
+
+    cv::parallel_for_(cv::Range(0, numTiles), [&](const cv::Range& range) {
+        int _dists[tileCols];
+
+        for (int t = range.start; t < range.end; ++t) {
+            std::vector<KnnPair>& _rKnn = _tileRKnn[t]; _rKnn.assign(numR, KnnPair());
+
+            const int lBegin = t * tileRows, lEnd = std::min(lBegin + tileRows, numL);
+
+            for (int rBegin = 0; rBegin < numR; rBegin += tileCols) {
+                const int rEnd = std::min(rBegin + tileCols, numR);
+
+                for (int i = lBegin; i < lEnd; ++i) {
+                    kernel(_lDesc.ptr<uchar>(i), &_rRows[rBegin], rEnd - rBegin, numBytes, _dists);
+
+                    KnnPair& _lPair = lKnn[i];
+
+                    for (int j = rBegin; j < rEnd; ++j) {
+                        const int dist = _dists[j - rBegin];
+
+                        _lPair.update(dist, j);
+                        _rKnn[j].update(dist, i);
+                    }
+                }
+            }
+        }
+    });
+
+    // merge in tile order -> lower index wins on equal distance like in the left direction
+    for (int t = 0; t < numTiles; ++t) {
+        for (int j = 0; j < numR; ++j)
+            rKnn[j].merge(_tileRKnn[t][j]);
+    }
+}
+
+OptFlow::OptFlow(cv::TermCriteria termcrit, int winSize, int maxLevel, float maxError, uint maxCorners, float qualityLevel, float minCornersDistance, uint minFeatures, uint numThreads, uint gridSize, uint cellMaxCorners) {
     optFlow = cv::SparsePyrLKOpticalFlow::create(cv::Size(winSize, winSize), maxLevel, termcrit);
 
     additionalSettings.setMaxError(maxError);
@@ -233,19 +606,77 @@ OptFlow::OptFlow(cv::TermCriteria termcrit, int winSize, int maxLevel, float max
     additionalSettings.setQualityLvl(qualityLevel);
     additionalSettings.setMinDistance(minCornersDistance);
     additionalSettings.setMinFeatures(minFeatures);
+    additionalSettings.setNumThreads(numThreads);
+    additionalSettings.setGridSize(gridSize);
+    additionalSettings.setCellMaxCorners(cellMaxCorners);
+}
+
+void OptFlow::filterByError(FlowTracks& tracks) {
+    const size_t numPoints = tracks.statusMask.size();
+
+    for (size_t i = 0; i < numPoints; ++i) {
+        if (tracks.error[i] > additionalSettings.maxError) 
+            tracks.statusMask[i] = false;
+    }
 }
 
-void OptFlow::computeFlow(cv::Mat imPrevGray, cv::Mat imCurrGray, std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, std::vector<uchar>& statusMask) {
-    std::vector<float> _err;
+void OptFlow::computeFlow(cv::Mat imPrevGray, cv::Mat imCurrGray, FlowTracks& tracks) {
+    optFlow->calc(imPrevGray, imCurrGray, tracks.prevPts, tracks.currPts, tracks.statusMask, tracks.error);
 
-    optFlow->calc(imPrevGray, imCurrGray, prevPts, currPts, statusMask, _err);
+    filterByError(tracks);
+}
 
-    const size_t numPoints = statusMask.size();
+void OptFlow::computeFlow(ViewData* prevView, ViewData* currView, FlowTracks& tracks) {
+    const cv::Size winSize = optFlow->getWinSize();
+    const int maxLevel = optFlow->getMaxLevel();
 
-    for (size_t i = 0; i < numPoints; ++i) {
-        if (_err[i] > additionalSettings.maxError) 
-            statusMask[i] = false;
+    // pyramids are passed instead of images -> calc skips pyramid building
+    const std::vector<cv::Mat>& prevPyr = prevView->getPyramid(winSize, maxLevel);
+    const std::vector<cv::Mat>& currPyr = currView->getPyramid(winSize, maxLevel);
+
+    if (additionalSettings.numThreads > 1 && tracks.size() > additionalSettings.numThreads) {
+        computeFlowParallel(prevPyr, currPyr, tracks);
+
+        return;
     }
+
+    optFlow->calc(prevPyr, currPyr, tracks.prevPts, tracks.currPts, tracks.statusMask, tracks.error);
+
+    filterByError(tracks);
+}
+
+void OptFlow::computeFlowParallel(const std::vector<cv::Mat>& prevPyr, const std::vector<cv::Mat>& currPyr, FlowTracks& tracks) {
+    const size_t numPoints = tracks.size();
+    const int numChunks = (int)additionalSettings.numThreads;
+
+    tracks.currPts.resize(numPoints);
+    tracks.statusMask.resize(numPoints);
+    tracks.error.resize(numPoints);
+
+    // chunks write to own rows of output arrays -> no synchronization needed
+    cv::Mat _prevPts(tracks.prevPts), _currPts(tracks.currPts), _status(tracks.statusMask), _err(tracks.error);
+
+    cv::parallel_for_(cv::Range(0, numChunks), [&](const cv::Range& range) {
+        for (int c = range.start; c < range.end; ++c) {
+            const int begin = (int)(numPoints * c / numChunks);
+            const int end = (int)(numPoints * (c + 1) / numChunks);
+
+            if (begin == end) { continue; }
+
+            cv::Mat _chunkCurrPts = _currPts.rowRange(begin, end);
+            cv::Mat _chunkStatus = _status.rowRange(begin, end);
+            cv::Mat _chunkErr = _err.rowRange(begin, end);
+
+            // own LK instance per chunk, pyramids are only read
+            cv::calcOpticalFlowPyrLK(prevPyr, currPyr, _prevPts.rowRange(begin, end), _chunkCurrPts, _chunkStatus, _chunkErr, optFlow->getWinSize(), optFlow->getMaxLevel(), optFlow->getTermCriteria(), optFlow->getFlags(), optFlow->getMinEigThreshold());
+
+            // error filtering fused into the same pass
+            for (int i = begin; i < end; ++i) {
+                if (tracks.error[i] > additionalSettings.maxError) 
+                    tracks.statusMask[i] = false;
+            }
+        }
+    }, numChunks);
 }
 
 void OptFlow::correctComputedPoints(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts) {
@@ -317,45 +748,41 @@ void OptFlow::drawOpticalFlow(cv::Mat inputImg, cv::Mat& outputImg, const std::v
 }
 
 void ProcesingAdds::filterPointsByBoundary(std::vector<cv::Point2f>& points, const cv::Rect boundary) {
-    std::vector<cv::Point2f> _emptyPoints;
-
-    filterPointsByBoundary(_emptyPoints, points, boundary);
+    points.erase(std::remove_if(points.begin(), points.end(), [&boundary](const cv::Point2f& pt) {
+        return !boundary.contains(pt);
+    }), points.end());
 }
 
 void ProcesingAdds::filterPointsByStatusMask(std::vector<cv::Point2f>& points, const std::vector<uchar>& statusMask) {
-    std::vector<cv::Point2f> _emptyPoints;
+    const size_t numPoints = std::min(points.size(), statusMask.size());
+
+    size_t newIdx = 0;
 
-    filterPointsByStatusMask(_emptyPoints, points, statusMask);
+    for (size_t i = 0; i < numPoints; ++i) {
+        if (statusMask[i]) 
+            points[newIdx++] = points[i];
+    }
+
+    points.resize(newIdx);
 }
 
-void ProcesingAdds::filterPointsByBoundary(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, const cv::Rect boundary) {
-    const size_t numPoints = currPts.size();
+void ProcesingAdds::filterPointsByBoundary(FlowTracks& tracks, const cv::Rect boundary) {
+    if (tracks.currPts.size() != tracks.size()) { return; }
 
-    for (size_t i = 0, idxCorrection = 0; i < numPoints; ++i) {
-        cv::Point2f pt = currPts[i - idxCorrection];
+    const size_t numPoints = tracks.currPts.size();
 
-        if (!boundary.contains(pt)) {
-            currPts.erase(currPts.begin() + (i - idxCorrection));
-            
-            if (!prevPts.empty())
-                prevPts.erase(prevPts.begin() + (i - idxCorrection));
-        }
-    }
-}
+    std::vector<uchar>& _inBoundary = tracks.getKeepMask();
 
-void ProcesingAdds::filterPointsByStatusMask(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, const std::vector<uchar>& statusMask) {
-    const size_t numPoints = currPts.size();
+    for (size_t i = 0; i < numPoints; ++i)
+        _inBoundary[i] = boundary.contains(tracks.currPts[i]);
 
-    for (size_t i = 0, idxCorrection = 0; i < numPoints; ++i) {
-        cv::Point2f pt = currPts[i - idxCorrection];
+    tracks.compact(_inBoundary);
+}
 
-        if (!statusMask[i]) {
-            currPts.erase(currPts.begin() + (i - idxCorrection));
-            
-            if (!prevPts.empty())
-                prevPts.erase(prevPts.begin() + (i - idxCorrection));
-        }
-    }
+void ProcesingAdds::filterPointsByStatusMask(FlowTracks& tracks) {
+    if (tracks.statusMask.size() != tracks.size()) { return; }
+
+    tracks.compact(tracks.statusMask);
 }
 
 void ProcesingAdds::analyzePointsMove(std::vector<cv::Point2f>& inPrevPts, std::vector<cv::Point2f>& inCurrPts, PointsMove& outPointsMove) {
@@ -0,0 +1,109 @@
+#include "frame_prefetcher.h"
+
+FramePrefetcher::FramePrefetcher(cv::VideoCapture* cap, const float downSample, const uint queueSize)
+    : m_cap(cap), m_downSample(downSample), m_queueSize(queueSize), m_isSourceLost(false), m_isStopped(false) {}
+
+FramePrefetcher::~FramePrefetcher() {
+    stop();
+}
+
+bool FramePrefetcher::loadFrame(cv::Mat& imColor, cv::Mat& imGray) {
+    if (m_downSample != 1.0f) {
+        if (!m_cap->read(m_imSource))
+            return false;
+
+        // resize to separate buffer -> avoid reallocation of source image
+        cv::resize(m_imSource, imColor, cv::Size(m_imSource.cols/m_downSample, m_imSource.rows/m_downSample));
+    } else if (!m_cap->read(imColor))
+        return false;
+
+    cv::cvtColor(imColor, imGray, cv::COLOR_BGR2GRAY);
+
+    return true;
+}
+
+void FramePrefetcher::start() {
+    if (m_queueSize == 0 || m_loadThread.joinable()) { return; }
+
+    m_isStopped = false;
+
+    m_loadThread = std::thread(&FramePrefetcher::prefetch, this);
+}
+
+void FramePrefetcher::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_queueMutex);
+
+        m_isStopped = true;
+    }
+
+    m_queueNotFull.notify_all();
+    m_queueNotEmpty.notify_all();
+
+    if (m_loadThread.joinable()) { m_loadThread.join(); }
+}
+
+void FramePrefetcher::prefetch() {
+    while (true) {
+        Frame frame;
+
+        {
+            std::unique_lock<std::mutex> lock(m_queueMutex);
+
+            m_queueNotFull.wait(lock, [this]{ return m_isStopped || m_queue.size() < m_queueSize; });
+
+            if (m_isStopped) { return; }
+
+            // take already allocated buffers from consumed frames
+            if (!m_freeFrames.empty()) {
+                std::swap(frame, m_freeFrames.back());
+                m_freeFrames.pop_back();
+            }
+        }
+
+        // decode outside of lock -> solver can consume prepared frames meanwhile
+        const bool isLoaded = loadFrame(frame.imColor, frame.imGray);
+
+        {
+            std::lock_guard<std::mutex> lock(m_queueMutex);
+
+            if (isLoaded)
+                m_queue.push_back(std::move(frame));
+            else
+                m_isSourceLost = true;
+        }
+
+        m_queueNotEmpty.notify_one();
+
+        if (!isLoaded) { return; }
+    }
+}
+
+bool FramePrefetcher::read(cv::Mat& imColor, cv::Mat& imGray) {
+    // no queue -> load in caller thread
+    if (m_queueSize == 0)
+        return loadFrame(imColor, imGray);
+
+    std::unique_lock<std::mutex> lock(m_queueMutex);
+
+    m_queueNotEmpty.wait(lock, [this]{ return m_isStopped || m_isSourceLost || !m_queue.empty(); });
+
+    if (m_queue.empty()) { return false; }
+
+    Frame& frame = m_queue.front();
+
+    std::swap(imColor, frame.imColor);
+    std::swap(imGray, frame.imGray);
+
+    // return previous caller buffers to background thread
+    if (isReusable(frame.imColor) && isReusable(frame.imGray))
+        m_freeFrames.push_back(std::move(frame));
+
+    m_queue.pop_front();
+
+    lock.unlock();
+
+    m_queueNotFull.notify_one();
+
+    return true;
+}
@@ -1,102 +1,368 @@
 #include "reconstruction.h"
 
-Reconstruction::Reconstruction(const std::string triangulateMethod, const std::string baMethod, const double baMaxRMSE, const float minDistance, const float maxDistance, const float maxProjectionError, const bool useNormalizePts)
-    : m_triangulateMethod(triangulateMethod), m_baMethod(baMethod), m_baMaxRMSE(baMaxRMSE), m_minDistance(minDistance), m_maxDistance(maxDistance), m_maxProjectionError(maxProjectionError), m_useNormalizePts(useNormalizePts), m_numOptimizations(0) {}
+Reconstruction::Reconstruction(const std::string baMethod, const double baMaxRMSE, const float minDistance, const float maxDistance, const float maxProjectionError, const bool useNormalizePts)
+    : m_baMethod(baMethod), m_baMaxRMSE(baMaxRMSE), m_minDistance(minDistance), m_maxDistance(maxDistance), m_maxProjectionError(maxProjectionError), m_useNormalizePts(useNormalizePts), m_numOptimizations(0), m_baNumRows(0), m_baWindowStart(0) {
+    ceres::Problem::Options problemOptions;
 
-void Reconstruction::pointsToRGBCloud(CameraParameters camera, cv::Mat imgColor, cv::Matx33d R, cv::Matx31d t, cv::Mat points3D, cv::Mat inputPts2D, std::vector<cv::Vec3d>& cloud3D, std::vector<cv::Vec3b>& cloudRGB, float minDist, float maxDist, float maxProjErr, std::vector<bool>& mask) {
-    //  Project 3D points back to image plane for validation
-    cv::Mat _pts2D; cv::projectPoints(points3D, cv::Mat(R), cv::Mat(t), camera.K, cv::Mat(), _pts2D);
+    // masked cloud points are removed from long-lived problem
+    problemOptions.enable_fast_removal = true;
 
-    cloud3D.clear();
-    cloudRGB.clear();
-    
-    cv::Matx34d cameraPose; composeExtrinsicMat(R, t, cameraPose);
-    const cv::Matx34d cameraProjMat = camera.K33d * cameraPose;
-
-    for(size_t i = 0; i < points3D.rows; ++i) {
-        const cv::Vec2d _point2D = _pts2D.at<cv::Vec2d>(i);
-        const cv::Vec3d point3D = points3D.at<cv::Vec3d>(i);
-        const cv::Vec2d point2D = inputPts2D.at<cv::Vec2d>(i);
-        const cv::Vec3b imPoint2D = imgColor.at<cv::Vec3b>(cv::Point(point2D));
-
-        const double err = cv::norm(_point2D - point2D);
-
-        cloud3D.push_back( point3D );
-        cloudRGB.push_back( imPoint2D );
-
-        // transfer point from world space to camera space
-        const cv::Matx31d pCameraSpace = cameraProjMat * cv::Matx41d(
-            point3D[0],
-            point3D[1],
-            point3D[2],
-            1.0
-        );
+    m_baProblem.reset(new ceres::Problem(problemOptions));
+}
+
+/** 
+ * Linear least squares triangulation of one point from N views
+ * Homogeneous DLT rows are solved for inhomogeneous point by 3x3 normal equations
+ * 
+ * @return false for degenerate configuration
+ */
+static inline bool triangulatePoint(const cv::Matx34d* const* P, const cv::Point2d* p, const int numViews, cv::Vec3d& point3D) {
+    cv::Matx33d N = cv::Matx33d::zeros();
+    cv::Vec3d b(0, 0, 0);
+
+    for (int v = 0; v < numViews; ++v) {
+        const cv::Matx34d& _P = *P[v];
+
+        for (int r = 0; r < 2; ++r) {
+            const double coord = r == 0 ? p[v].x : p[v].y;
+
+            // row of DLT system -> coord * P[2] - P[r]
+            const double a0 = coord * _P(2, 0) - _P(r, 0);
+            const double a1 = coord * _P(2, 1) - _P(r, 1);
+            const double a2 = coord * _P(2, 2) - _P(r, 2);
+            const double a3 = coord * _P(2, 3) - _P(r, 3);
+
+            N(0, 0) += a0 * a0; N(0, 1) += a0 * a1; N(0, 2) += a0 * a2;
+            N(1, 1) += a1 * a1; N(1, 2) += a1 * a2; N(2, 2) += a2 * a2;
 
-        //  set mask to filter bad projected points, points behind camera and points far away from camera
-        mask.push_back( err <  maxProjErr && pCameraSpace(2) > minDist && pCameraSpace(2) < maxDist );
-        //mask.push_back( err <  maxProjErr );
+            b[0] -= a0 * a3; b[1] -= a1 * a3; b[2] -= a2 * a3;
+        }
     }
+
+    N(1, 0) = N(0, 1); N(2, 0) = N(0, 2); N(2, 1) = N(1, 2);
+
+    const double det = cv::determinant(N);
+
+    if (std::abs(det) < 1e-12 * std::max(1.0, N(0, 0) * N(1, 1) * N(2, 2))) { return false; }
+
+    point3D = N.inv(cv::DECOMP_LU) * b;
+
+    return true;
 }
 
-void Reconstruction::triangulateCloud(CameraParameters camera, const std::vector<cv::Point2f> prevPts, const std::vector<cv::Point2f> currPts, const cv::Mat colorImage, std::vector<cv::Vec3d>& points3D, std::vector<cv::Vec3b>& pointsRGB, std::vector<bool>& mask, const cv::Matx34d prevPose, const cv::Matx34d currPose, cv::Matx33d& R, cv::Matx31d& t) {
-    if (prevPts.empty() || currPts.empty()) { return; }
-    
-    cv::Mat _prevPtsN; cv::undistort(prevPts, _prevPtsN, camera.K33d, cv::Mat());
-    cv::Mat _currPtsN; cv::undistort(currPts, _currPtsN, camera.K33d, cv::Mat());
+void Reconstruction::triangulateCloud(const CameraParameters& camera, const std::vector<cv::Point2f>& prevPts, const std::vector<cv::Point2f>& currPts, const cv::Mat& colorImage, std::vector<cv::Vec3d>& points3D, std::vector<cv::Vec3b>& pointsRGB, std::vector<bool>& mask, const cv::Matx34d& prevPose, const cv::Matx34d& currPose, const cv::Matx33d& R, const cv::Matx31d& t) {
+    const int numPts = std::min(prevPts.size(), currPts.size());
 
-    cv::Mat _prevPtsMat, _currPtsMat; 
+    points3D.resize(numPts);
+    pointsRGB.resize(numPts);
+    mask.assign(numPts, false);
 
-    if (m_useNormalizePts) {
-        pointsToMat(_prevPtsN, _prevPtsMat);
-        pointsToMat(_currPtsN, _currPtsMat);
-    } else {
-        pointsToMat(prevPts, _prevPtsMat);
-        pointsToMat(currPts, _currPtsMat);
+    if (numPts == 0) { return; }
+
+    // normalized points are triangulated by poses, pixel points by projection matrices
+    const cv::Matx33d Kinv = camera.K33d.inv();
+
+    const cv::Matx34d prevP = m_useNormalizePts ? prevPose : camera.K33d * prevPose;
+    const cv::Matx34d currP = m_useNormalizePts ? currPose : camera.K33d * currPose;
+
+    const cv::Rect imBoundary(cv::Point(), colorImage.size());
+
+    // vector<bool> cannot be written in parallel
+    std::vector<uchar> _mask(numPts, 0);
+
+    cv::parallel_for_(cv::Range(0, numPts), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; ++i) {
+            cv::Point2d _prevPt = prevPts[i], _currPt = currPts[i];
+
+            if (m_useNormalizePts) {
+                const cv::Vec3d _prevN = Kinv * cv::Vec3d(_prevPt.x, _prevPt.y, 1.0);
+                const cv::Vec3d _currN = Kinv * cv::Vec3d(_currPt.x, _currPt.y, 1.0);
+
+                _prevPt = cv::Point2d(_prevN[0] / _prevN[2], _prevN[1] / _prevN[2]);
+                _currPt = cv::Point2d(_currN[0] / _currN[2], _currN[1] / _currN[2]);
+            }
+
+            cv::Vec3d& _point3D = points3D[i];
+
+            const cv::Matx34d* _P[2] = { &prevP, &currP };
+            const cv::Point2d _pts[2] = { _prevPt, _currPt };
+
+            if (!triangulatePoint(_P, _pts, 2, _point3D)) {
+                _point3D = cv::Vec3d(0, 0, 0);
+                pointsRGB[i] = cv::Vec3b(0, 0, 0);
+
+                continue;
+            }
+
+            //  transfer point to current camera space -> depth and reprojection
+            const cv::Vec3d _pCameraSpace = R * _point3D + cv::Vec3d(t(0), t(1), t(2));
+            const cv::Vec3d _proj = camera.K33d * _pCameraSpace;
+
+            const double err = cv::norm(cv::Point2d(_proj[0] / _proj[2], _proj[1] / _proj[2]) - cv::Point2d(currPts[i]));
+
+            const cv::Point _imPoint(cvRound(currPts[i].x), cvRound(currPts[i].y));
+
+            pointsRGB[i] = imBoundary.contains(_imPoint) ? colorImage.at<cv::Vec3b>(_imPoint) : cv::Vec3b(0, 0, 0);
+
+            //  set mask to filter bad projected points, points behind camera and points far away from camera
+            _mask[i] = err < m_maxProjectionError && _pCameraSpace[2] > m_minDistance && _pCameraSpace[2] < m_maxDistance;
+        }
+    });
+
+    for (int i = 0; i < numPts; ++i)
+        mask[i] = _mask[i] != 0;
+}
+
+/** 
+ * Reprojection error of point in pixels and cheirality in all views
+ */
+static inline double reprojectionRMSE(const cv::Matx33d* const* KR, const cv::Vec3d* const* Kt, const cv::Point2d* p, const int numViews, const cv::Vec3d& point3D, bool& isInFront) {
+    double sqErr = 0; isInFront = true;
+
+    for (int v = 0; v < numViews; ++v) {
+        const cv::Vec3d _proj = *KR[v] * point3D + *Kt[v];
+
+        if (_proj[2] <= 0) { isInFront = false; }
+
+        const double du = _proj[0] / _proj[2] - p[v].x, dv = _proj[1] / _proj[2] - p[v].y;
+
+        sqErr += du * du + dv * dv;
     }
 
-    cv::Mat _homogPts, _pts3D;
+    return std::sqrt(sqErr / numViews);
+}
+
+void Reconstruction::retriangulateCloud(CameraData& cameraData, PointCloud& pointCloud, const uint minViews, const uint windowSize) {
+    if (minViews < 2 || pointCloud.cloudObservations.empty() || cameraData.extrinsics.empty()) { return; }
+
+    std::cout << "Retriangulating cloud..." << std::flush;
+
+    const cv::Matx33d& K = cameraData.intrinsics->K33d;
+    const cv::Matx33d Kinv = K.inv();
+
+    // camera poses for triangulation and K*R, K*t for reprojection
+    std::vector<cv::Matx34d> _poses(cameraData.extrinsics.begin(), cameraData.extrinsics.end());
+    std::vector<cv::Matx33d> _KR(_poses.size());
+    std::vector<cv::Vec3d> _Kt(_poses.size());
 
-    if (m_triangulateMethod == "DLT") {
-        std::vector<cv::Mat> _pts, _projMats;
-        _pts.push_back(_prevPtsMat);
-        _pts.push_back(_currPtsMat);
-        _projMats.push_back(cv::Mat(camera.K33d * prevPose));
-        _projMats.push_back(cv::Mat(camera.K33d * currPose));
+    for (size_t c = 0; c < _poses.size(); ++c) {
+        cv::Matx33d R; cv::Vec3d t; decomposeExtrinsicMat(_poses[c], R, t);
 
-        //cv::sfm::triangulatePoints(_pts, _projMats, _pts3D); _pts3D = _pts3D.t();
+        _KR[c] = K * R;
+        _Kt[c] = K * t;
+
+        if (!m_useNormalizePts)
+            _poses[c] = K * _poses[c];
+    }
+
+    const CloudObservations& observations = pointCloud.cloudObservations;
+
+    // point queries in parallel are read only
+    observations.updatePointIndex();
+
+    const size_t windowStart = windowSize != 0 && windowSize < _poses.size() ? _poses.size() - windowSize : 0;
+
+    // local mode -> points observed by window cameras, their rows are at the end of table
+    std::vector<size_t> _cloudIdxs;
+
+    if (windowStart > 0) {
+        for (size_t row = observations.getFirstCameraRow(windowStart); row < observations.size(); ++row)
+            _cloudIdxs.push_back(observations[row].cloudIdx);
+
+        std::sort(_cloudIdxs.begin(), _cloudIdxs.end());
+        _cloudIdxs.erase(std::unique(_cloudIdxs.begin(), _cloudIdxs.end()), _cloudIdxs.end());
     } else {
-        cv::triangulatePoints(camera.K33d * prevPose, camera.K33d * currPose, _prevPtsMat, _currPtsMat, _homogPts);
-        cv::convertPointsFromHomogeneous(_homogPts.t(), _pts3D);
+        _cloudIdxs.resize(pointCloud.cloud3D.size());
+
+        std::iota(_cloudIdxs.begin(), _cloudIdxs.end(), 0);
     }
 
-    pointsToRGBCloud(camera, colorImage, R, t, _pts3D, _currPtsMat.t(), points3D, pointsRGB, m_minDistance, m_maxDistance, m_maxProjectionError, mask);
+    std::vector<uchar> _isUpdated(_cloudIdxs.size(), 0);
+
+    // points are independent -> one task per point range
+    cv::parallel_for_(cv::Range(0, _cloudIdxs.size()), [&](const cv::Range& range) {
+        std::vector<const cv::Matx34d*> _P;
+        std::vector<const cv::Matx33d*> _pKR;
+        std::vector<const cv::Vec3d*> _pKt;
+        std::vector<cv::Point2d> _pts, _ptsN;
+
+        for (int u = range.start; u < range.end; ++u) {
+            const size_t i = _cloudIdxs[u];
+
+            size_t numRows; const size_t* _rows = observations.getPointRows(i, numRows);
+
+            if (!pointCloud.cloudMask[i] || numRows < minViews) { continue; }
+
+            _P.clear(); _pKR.clear(); _pKt.clear(); _pts.clear(); _ptsN.clear();
+
+            for (size_t r = 0; r < numRows; ++r) {
+                const CloudObservation& _obs = observations[_rows[r]];
+                const uint c = _obs.cameraIdx;
+
+                if (c >= _poses.size()) { continue; }
+
+                const cv::Point2d _pt = _obs.projKey;
+                const cv::Vec3d _ptN = Kinv * cv::Vec3d(_pt.x, _pt.y, 1.0);
+
+                _P.push_back(&_poses[c]);
+                _pKR.push_back(&_KR[c]);
+                _pKt.push_back(&_Kt[c]);
+                _pts.push_back(_pt);
+                _ptsN.push_back(cv::Point2d(_ptN[0] / _ptN[2], _ptN[1] / _ptN[2]));
+            }
+
+            const int numViews = _pts.size();
+
+            if (numViews < (int)minViews) { continue; }
+
+            cv::Vec3d _point3D;
+
+            if (!triangulatePoint(_P.data(), m_useNormalizePts ? _ptsN.data() : _pts.data(), numViews, _point3D)) { continue; }
+
+            // Gauss-Newton refinement of pixel reprojection error
+            for (int it = 0; it < 3; ++it) {
+                cv::Matx33d JtJ = cv::Matx33d::zeros(); cv::Vec3d Jtr(0, 0, 0);
+
+                for (int v = 0; v < numViews; ++v) {
+                    const cv::Matx33d& M = *_pKR[v];
+                    const cv::Vec3d _proj = M * _point3D + *_pKt[v];
+
+                    if (_proj[2] <= 0) { continue; }
+
+                    const double u = _proj[0] / _proj[2], w = _proj[1] / _proj[2];
+
+                    // d(u, w) / dX
+                    const cv::Vec3d Ju((M(0, 0) - u * M(2, 0)) / _proj[2], (M(0, 1) - u * M(2, 1)) / _proj[2], (M(0, 2) - u * M(2, 2)) / _proj[2]);
+                    const cv::Vec3d Jw((M(1, 0) - w * M(2, 0)) / _proj[2], (M(1, 1) - w * M(2, 1)) / _proj[2], (M(1, 2) - w * M(2, 2)) / _proj[2]);
+
+                    JtJ += Ju * Ju.t() + Jw * Jw.t();
+                    Jtr += Ju * (u - _pts[v].x) + Jw * (w - _pts[v].y);
+                }
+
+                if (std::abs(cv::determinant(JtJ)) < 1e-18) { break; }
+
+                _point3D -= JtJ.inv(cv::DECOMP_CHOLESKY) * Jtr;
+            }
+
+            bool isNewInFront, isOldInFront;
+
+            const double newErr = reprojectionRMSE(_pKR.data(), _pKt.data(), _pts.data(), numViews, _point3D, isNewInFront);
+            const double oldErr = reprojectionRMSE(_pKR.data(), _pKt.data(), _pts.data(), numViews, pointCloud.cloud3D[i], isOldInFront);
+
+            // keep point if the new one is not better
+            if (isNewInFront && (newErr < oldErr || !isOldInFront)) {
+                pointCloud.cloud3D[i] = _point3D;
+
+                _isUpdated[u] = 1;
+            }
+        }
+    });
+
+    std::cout << "[DONE] Updated points: " << std::count(_isUpdated.begin(), _isUpdated.end(), 1) << "\n";
 }
 
-void Reconstruction::adjustBundle(CameraData& cameraData, PointCloud& pointCloud) {
-    std::cout << "Bundle adjustment...\n" << std::flush;
+/** 
+ * Extend camera extrinsics to homogeneous transform
+ */
+static inline cv::Matx44d toHomogeneousMat(const cv::Matx34d& pose) {
+    return cv::Matx44d(
+        pose(0, 0), pose(0, 1), pose(0, 2), pose(0, 3),
+        pose(1, 0), pose(1, 1), pose(1, 2), pose(1, 3),
+        pose(2, 0), pose(2, 1), pose(2, 2), pose(2, 3),
+        0, 0, 0, 1
+    );
+}
+
+static inline bool isEmptyPose(const cv::Matx34d& pose) {
+    return pose(0, 0) == 0 && pose(1, 1) == 0 && pose(2, 2) == 0;
+}
+
+/** 
+ * Pixel reprojection RMSE of all current observations of cloud points touched by snapshot merge
+ * Points added after snapshot are touched by pose correction
+ * Observations on or behind camera are skipped and counted to numBehind
+ */
+static double mapReprojectionRMSE(const BundleSnapshot& snapshot, const CameraData& cameraData, const PointCloud& pointCloud, size_t& numBehind) {
+    const cv::Matx33d& K = cameraData.intrinsics->K33d;
+
+    std::vector<cv::Matx34d> _KP; _KP.reserve(cameraData.extrinsics.size());
+
+    for (const auto& pose : cameraData.extrinsics)
+        _KP.push_back(K * pose);
 
-    if (pointCloud.cloudTracks.empty()) {
+    double sqErr = 0; size_t numObs = 0; numBehind = 0;
+
+    std::vector<size_t> _cloudIdxs(snapshot.cloudIdxs);
+
+    for (size_t pIdx = snapshot.numCloudPts; pIdx < pointCloud.cloud3D.size(); ++pIdx)
+        _cloudIdxs.push_back(pIdx);
+
+    for (const auto& idx : _cloudIdxs) {
+        const cv::Vec3d& p3d = pointCloud.cloud3D[idx];
+
+        const cv::Vec4d _p3d(p3d[0], p3d[1], p3d[2], 1.0);
+
+        size_t numRows; const size_t* _rows = pointCloud.cloudObservations.getPointRows(idx, numRows);
+
+        for (size_t r = 0; r < numRows; ++r) {
+            const CloudObservation& _obs = pointCloud.cloudObservations[_rows[r]];
+
+            if (_obs.cameraIdx >= _KP.size()) { continue; }
+
+            const cv::Vec3d _proj = _KP[_obs.cameraIdx] * _p3d;
+
+            if (_proj[2] <= 0) { numBehind++; continue; }
+
+            const double du = _proj[0] / _proj[2] - _obs.projKey.x, dv = _proj[1] / _proj[2] - _obs.projKey.y;
+
+            sqErr += du * du + dv * dv; numObs++;
+        }
+    }
+
+    return numObs > 0 ? std::sqrt(sqErr / numObs) : 0.0;
+}
+
+bool Reconstruction::prepareBundle(CameraData& cameraData, PointCloud& pointCloud, const uint windowSize, BundleSnapshot& snapshot) {
+    if (pointCloud.cloudObservations.empty() || cameraData.extrinsics.empty()) {
         std::cout << "Empty cloud -> interrupting bundle adjustment!" << "\n";
 
-        return;
+        return false;
     }
 
+    // cameras before window start are not optimized
+    snapshot.windowStart = windowSize != 0 && windowSize < cameraData.extrinsics.size() ? cameraData.extrinsics.size() - windowSize : 0;
+
+    snapshot.numCameras = cameraData.extrinsics.size();
+    snapshot.numCloudPts = pointCloud.cloud3D.size();
+
     // parse camera intrinsic parameters
-    cv::Matx14d intrinsics4d (
+    m_baIntrinsics4d = cv::Matx14d(
         cameraData.intrinsics->focal.x,
         cameraData.intrinsics->focal.y,
         cameraData.intrinsics->pp.x,
         cameraData.intrinsics->pp.y
     );
 
-    // parse camera extrinsics parameters
-    std::vector<cv::Matx16d> extrinsics6d;
+    // parse camera extrinsics parameters -> only new and changed poses are converted
+    for (auto [c, cEnd, it] = std::tuple{cameraData.extrinsics.cbegin(), cameraData.extrinsics.cend(), 0u}; c != cEnd; ++c, ++it) {
+        if (it == m_baExtrinsics6d.size()) {
+            m_baExtrinsics6d.push_back(cv::Matx16d());
+            m_baPoses.push_back(cv::Matx34d());
+            m_baIsPoseSynced.push_back(false);
+        }
+
+        if (it >= snapshot.windowStart)
+            cameraData.extrinsicsCounter[it] = 0;
 
-    for (auto [c, cEnd, it] = std::tuple{cameraData.extrinsics.cbegin(), cameraData.extrinsics.cend(), 0}; c != cEnd; ++c, ++it) {
         cv::Matx34d cam = (cv::Matx34d)*c;
 
-        if (cam(0, 0) == 0 && cam(1, 1) == 0 && cam(2, 2) == 0) { 
-            extrinsics6d.push_back(cv::Matx16d());
+        if (m_baIsPoseSynced[it] && cam == m_baPoses[it]) { continue; }
+
+        m_baPoses[it] = cam;
+        m_baIsPoseSynced[it] = true;
+
+        if (isEmptyPose(cam)) { 
+            m_baExtrinsics6d[it] = cv::Matx16d();
             continue; 
         }
 
@@ -104,61 +370,226 @@ void Reconstruction::adjustBundle(CameraData& cameraData, PointCloud& pointCloud
         cv::Matx33f R = cam.get_minor<3, 3>(0, 0);
         float angleAxis[3]; ceres::RotationMatrixToAngleAxis<float>(R.t().val, angleAxis);
 
-        extrinsics6d.push_back(cv::Matx16d(
+        m_baExtrinsics6d[it] = cv::Matx16d(
             angleAxis[0],
             angleAxis[1],
             angleAxis[2],
             t(0),
             t(1),
             t(2)
-        ));
+        );
+    }
+
+    snapshot.cameraLocks.assign(snapshot.numCameras, false);
+    snapshot.cloudIdxs.clear();
+
+    const CloudObservations& observations = pointCloud.cloudObservations;
+
+    // rows of cameras not in map yet are at the end of table
+    const size_t numRows = observations.getFirstCameraRow(snapshot.numCameras);
+
+    auto addResidualBlock = [&](const CloudObservation& obs) {
+#if BA_ANALYTIC_JACOBIANS
+        ceres::CostFunction* costFunc = SnavelyReprojectionCost::Create(obs.projKey.x, obs.projKey.y);
+#else
+        ceres::CostFunction* costFunc = SnavelyReprojectionError::Create(obs.projKey.x, obs.projKey.y);
+#endif
+
+        m_baProblem->AddResidualBlock(costFunc, NULL, m_baIntrinsics4d.val, m_baExtrinsics6d[obs.cameraIdx].val, m_baCloud3D[obs.cloudIdx].val);
+    };
+
+    // new cloud points -> parameter blocks are created variable with their first residual block
+    for (size_t pIdx = m_baCloud3D.size(); pIdx < snapshot.numCloudPts; ++pIdx) {
+        m_baCloud3D.push_back(pointCloud.cloud3D[pIdx]);
+        m_baIsPointRemoved.push_back(false);
+        m_baIsPointVariable.push_back(true);
+    }
+
+    // local mode -> only points observed by window cameras are optimized, their rows are at the end of table
+    // points outside of window are constant, their values and masks are synced when they are optimized again
+    std::vector<size_t> _cloudIdxs;
+
+    if (snapshot.windowStart > 0) {
+        for (size_t row = observations.getFirstCameraRow(snapshot.windowStart); row < numRows; ++row)
+            _cloudIdxs.push_back(observations[row].cloudIdx);
+
+        std::sort(_cloudIdxs.begin(), _cloudIdxs.end());
+        _cloudIdxs.erase(std::unique(_cloudIdxs.begin(), _cloudIdxs.end()), _cloudIdxs.end());
+    } else {
+        _cloudIdxs.resize(snapshot.numCloudPts);
 
-        cameraData.extrinsicsCounter[it] = 0;
+        std::iota(_cloudIdxs.begin(), _cloudIdxs.end(), 0);
     }
 
-    // make cloud backup to prevent worse optimalization result
-    const std::list<cv::Vec3d> _cloudBackUp(pointCloud.cloud3D);
+    for (const auto& pIdx : _cloudIdxs) {
+        double* point = m_baCloud3D[pIdx].val;
 
-    ceres::Problem problem;
+        if (!pointCloud.cloudMask[pIdx]) {
+            // filtered point -> its residual blocks are removed from problem
+            if (m_baProblem->HasParameterBlock(point))
+                m_baProblem->RemoveParameterBlock(point);
 
-    bool isBlockLocked = false; size_t numPtsAdded = 0;
-    for (auto [pMask, pMaskEnd, p, pEnd, pIdx] = std::tuple{pointCloud.cloudMask.begin(), pointCloud.cloudMask.end(), pointCloud.cloudTracks.begin(), pointCloud.cloudTracks.end(), 0}; pMask != pMaskEnd && p != pEnd; ++pMask, ++p, ++pIdx) {
-        if (!(bool)*pMask) { continue; }
+            m_baIsPointRemoved[pIdx] = true;
+            m_baIsPointVariable[pIdx] = true;
 
-        for (auto [c, ct, cEnd, ctEnd, tIdx] = std::tuple{p->projKeys.begin(), p->extrinsicsIdxs.begin(), p->projKeys.end(), p->extrinsicsIdxs.end(), 0}; c != cEnd && ct != ctEnd; ++c, ++ct, ++tIdx) {
-            cv::Point2f p2d = *c;
-            cv::Matx16d* ext = &extrinsics6d[*ct];
+            continue;
+        }
 
-            ceres::CostFunction* costFunc = SnavelyReprojectionError::Create(p2d.x, p2d.y);
+        // cloud point could be moved by retriangulation or previous merge
+        m_baCloud3D[pIdx] = pointCloud.cloud3D[pIdx];
 
-            // create problem to solve using residual blocks
-            // cloud 3D point positions will be updated
-            problem.AddResidualBlock(costFunc, NULL, intrinsics4d.val, ext->val, p->ptrPoint3D->val);
+        // visible again -> already processed observations are added again
+        if (m_baIsPointRemoved[pIdx]) {
+            size_t numPtRows; const size_t* _rows = observations.getPointRows(pIdx, numPtRows);
 
-            // lock to the first camera to prevent cloud scaling
-            // first camera extrinsics will not be updated
-            if (!isBlockLocked) {
-                problem.SetParameterBlockConstant(ext->val);
+            for (size_t r = 0; r < numPtRows && _rows[r] < m_baNumRows; ++r)
+                addResidualBlock(observations[_rows[r]]);
 
-                isBlockLocked = true;
-            }
+            m_baIsPointRemoved[pIdx] = false;
+        }
+    }
+
+    // points of blocks created by new rows -> they are set constant if they are not in window
+    std::vector<size_t> _addedCloudIdxs;
+
+    // add residual blocks only for newly registered observations
+    const size_t numObsAdded = numRows - std::min(m_baNumRows, numRows);
+
+    for (size_t row = m_baNumRows; row < numRows; ++row) {
+        const CloudObservation& obs = observations[row];
+
+        // removed point gets all its observations when it is optimized again
+        if (pointCloud.cloudMask[obs.cloudIdx] && !m_baIsPointRemoved[obs.cloudIdx]) {
+            addResidualBlock(obs);
+
+            _addedCloudIdxs.push_back(obs.cloudIdx);
+
+            continue;
+        }
+
+        // filtered point outside of window could still have residual blocks
+        double* point = m_baCloud3D[obs.cloudIdx].val;
+
+        if (m_baProblem->HasParameterBlock(point))
+            m_baProblem->RemoveParameterBlock(point);
+
+        m_baIsPointRemoved[obs.cloudIdx] = true;
+        m_baIsPointVariable[obs.cloudIdx] = true;
+    }
+
+    m_baNumRows = std::max(m_baNumRows, numRows);
+
+    auto isOptimizedPoint = [&](const size_t pIdx) {
+        return snapshot.windowStart == 0 || std::binary_search(_cloudIdxs.begin(), _cloudIdxs.end(), pIdx);
+    };
+
+    // points optimized by previous adjustment could be restored by rollback -> they are synced when they leave window
+    for (const auto& pIdx : m_baVariablePts) {
+        if (isOptimizedPoint(pIdx) || !pointCloud.cloudMask[pIdx]) { continue; }
+
+        m_baCloud3D[pIdx] = pointCloud.cloud3D[pIdx];
+    }
+
+    // toggle only points whose window membership changed
+    for (const auto* _leftCloudIdxs : { &m_baVariablePts, &_addedCloudIdxs }) {
+        for (const auto& pIdx : *_leftCloudIdxs) {
+            double* point = m_baCloud3D[pIdx].val;
+
+            if (!m_baIsPointVariable[pIdx] || isOptimizedPoint(pIdx) || !m_baProblem->HasParameterBlock(point)) { continue; }
+
+            m_baProblem->SetParameterBlockConstant(point);
+
+            m_baIsPointVariable[pIdx] = false;
+        }
+    }
 
-            cameraData.extrinsicsCounter[*ct]++;
+    bool isBlockLocked = false; uint gaugeIdx = UINT_MAX;
+    for (const auto& pIdx : _cloudIdxs) {
+        double* point = m_baCloud3D[pIdx].val;
+
+        if (!pointCloud.cloudMask[pIdx] || !m_baProblem->HasParameterBlock(point)) { continue; }
+
+        if (!m_baIsPointVariable[pIdx]) {
+            m_baProblem->SetParameterBlockVariable(point);
+
+            m_baIsPointVariable[pIdx] = true;
+        }
+
+        snapshot.cloudIdxs.push_back(pIdx);
+
+        size_t numPtRows; const size_t* _rows = observations.getPointRows(pIdx, numPtRows);
+
+        for (size_t r = 0; r < numPtRows && _rows[r] < numRows; ++r) {
+            const uint cIdx = observations[_rows[r]].cameraIdx;
+
+            if (snapshot.windowStart > 0) {
+                // older cameras co-observing window points hold the cloud scale
+                if (cIdx < snapshot.windowStart) {
+                    snapshot.cameraLocks[cIdx] = true;
+
+                    isBlockLocked = true;
+
+                    continue;
+                }
+
+                gaugeIdx = std::min(gaugeIdx, cIdx);
+            } else if (gaugeIdx == UINT_MAX)
+                gaugeIdx = cIdx;
+
+            cameraData.extrinsicsCounter[cIdx]++;
         }
 
         pointCloud.cloudUpdates[pIdx]++;
     }
 
+    m_baVariablePts = snapshot.cloudIdxs;
+
     if (!isBlockLocked) {
-        std::cout << "Minimization is not ready, something went wrong! -> skipping process" << "\n";
+        if (gaugeIdx == UINT_MAX) {
+            std::cout << "Minimization is not ready, something went wrong! -> skipping process" << "\n";
+
+            return false;
+        }
 
-        return;
+        // lock to the first camera to prevent cloud scaling
+        // first camera extrinsics will not be updated
+        snapshot.cameraLocks[gaugeIdx] = true;
     }
-    
+
+    // cameras before both windows are constant already, new camera blocks are created variable
+    while (m_baIsCameraVariable.size() < snapshot.numCameras)
+        m_baIsCameraVariable.push_back(true);
+
+    for (uint c = std::min(m_baWindowStart, snapshot.windowStart); c < snapshot.numCameras; ++c) {
+        double* ext = m_baExtrinsics6d[c].val;
+
+        if (!m_baProblem->HasParameterBlock(ext)) { continue; }
+
+        const bool isVariable = c >= snapshot.windowStart && !snapshot.cameraLocks[c];
+
+        if (isVariable == m_baIsCameraVariable[c]) { continue; }
+
+        if (isVariable)
+            m_baProblem->SetParameterBlockVariable(ext);
+        else
+            m_baProblem->SetParameterBlockConstant(ext);
+
+        m_baIsCameraVariable[c] = isVariable;
+    }
+
+    m_baWindowStart = snapshot.windowStart;
+
     // lock to the camera intinsics to prevent cloud scaling
     // camera intinsics will not be updated
-    problem.SetParameterBlockConstant(&intrinsics4d(0));
+    if (m_baProblem->HasParameterBlock(m_baIntrinsics4d.val))
+        m_baProblem->SetParameterBlockConstant(m_baIntrinsics4d.val);
 
+    std::cout << "Bundle problem: " << m_baProblem->NumResidualBlocks() << " residual blocks, " << numObsAdded << " added" << "\n";
+
+    return true;
+}
+
+bool Reconstruction::solveBundle(const BundleSnapshot& snapshot) {
     ceres::Solver::Options options;
 
     options.linear_solver_type = m_baMethod == "DENSE_SCHUR" ? 
@@ -169,46 +600,65 @@ void Reconstruction::adjustBundle(CameraData& cameraData, PointCloud& pointCloud
 
     //options.preconditioner_type = ceres::SCHUR_JACOBI;
 
+    // residual blocks with constant parameters only are removed by solver preprocessor
     ceres::Solver::Summary summary;
-    ceres::Solve(options, &problem, &summary);
+    ceres::Solve(options, m_baProblem.get(), &summary);
     //std::cout << summary.FullReport() << "\n";
-    
-    // check minimalization result -> if it is bad, then restore from backup
-    if (!summary.IsSolutionUsable()) {
-		std::cout << "Bundle Adjustment failed -> recovering from back up!" << "\n";
 
-        pointCloud.cloud3D = _cloudBackUp;
+    bool isSolved = summary.IsSolutionUsable() && summary.num_residuals_reduced > 0;
+    
+    if (isSolved) {
+        // cost of removed constant residual blocks is not optimized
+        double initialRMSE = std::sqrt((summary.initial_cost - summary.fixed_cost) / summary.num_residuals_reduced);
+        double finalRMSE = std::sqrt((summary.final_cost - summary.fixed_cost) / summary.num_residuals_reduced);
+
+        // Display minimization result stats
+        std::cout << std::endl
+            << "Bundle Adjustment statistics (approximated RMSE):\n"
+            << " #views: " << snapshot.numCameras << "\n"
+            << " #window: " << snapshot.numCameras - snapshot.windowStart << "\n"
+            << " #num_residuals: " << summary.num_residuals_reduced << "\n"
+            << " Initial RMSE: " << initialRMSE << "\n"
+            << " Final RMSE: " << finalRMSE << "\n"
+            << " Time (s): " << summary.total_time_in_seconds << "\n"
+            << std::endl;
+
+        isSolved = finalRMSE <= initialRMSE && finalRMSE <= m_baMaxRMSE;
+    }
 
-        return;
-	} else {
-        double initialRMSE = std::sqrt(summary.initial_cost / summary.num_residuals);
-        double finalRMSE = std::sqrt(summary.final_cost / summary.num_residuals);
+    // check minimalization result -> if it is bad, then it is not applied
+    if (!isSolved) {
+        std::cout << "Bundle Adjustment failed -> keeping previous map!" << "\n";
 
-		// Display minimization result stats
-		std::cout << std::endl
-			<< "Bundle Adjustment statistics (approximated RMSE):\n"
-			<< " #views: " << cameraData.numCameras << "\n"
-			<< " #num_residuals: " << summary.num_residuals << "\n"
-			<< " Initial RMSE: " << initialRMSE << "\n"
-			<< " Final RMSE: " << finalRMSE << "\n"
-			<< " Time (s): " << summary.total_time_in_seconds << "\n"
-			<< std::endl;
+        // optimized camera blocks differ from map -> convert them again in next preparation
+        for (uint c = snapshot.windowStart; c < snapshot.numCameras; ++c)
+            m_baIsPoseSynced[c] = false;
+    }
 
-        if (finalRMSE > initialRMSE || finalRMSE > m_baMaxRMSE) {
-            std::cout << "Bundle Adjustment failed -> recovering from back up!" << "\n";
+    return isSolved;
+}
 
-            pointCloud.cloud3D = _cloudBackUp;
+void Reconstruction::applyBundle(const BundleSnapshot& snapshot, CameraData& cameraData, PointCloud& pointCloud, MapCheckpoint* checkpoint) {
+    // update optimized cloud points
+    for (const auto& idx : snapshot.cloudIdxs) {
+        if (checkpoint) { checkpoint->saveCloudPoint(pointCloud, idx); }
 
-            return;
-        }
-	}
+        pointCloud.cloud3D[idx] = m_baCloud3D[idx];
+    }
 
     // update camera extrinsics parameters
-    for (auto [c, cEnd, c6, c6End, it] = std::tuple{cameraData.extrinsics.begin(), cameraData.extrinsics.end(), extrinsics6d.begin(), extrinsics6d.end(), 0}; c != cEnd && c6 != c6End; ++c, ++c6, ++it) {
+    auto c = cameraData.extrinsics.begin();
+
+    cv::Matx34d lastPose = *std::next(c, snapshot.numCameras - 1);
+
+    for (uint it = 0; it < snapshot.numCameras; ++it, ++c) {
         cv::Matx34d& cam = (cv::Matx34d&)*c;
-        cv::Matx16d& cam6 = (cv::Matx16d&)*c6;
+        const cv::Matx16d& cam6 = m_baExtrinsics6d[it];
+
+        // cameras out of window and locked cameras were held constant
+        if (it < snapshot.windowStart || snapshot.cameraLocks[it] || isEmptyPose(cam)) { continue; }
 
-        if (cam(0, 0) == 0 && cam(1, 1) == 0 && cam(2, 2) == 0) { continue; }
+        if (checkpoint) { checkpoint->saveCamera(c); }
 
         double rotationMat[9] = { 0 };
         ceres::AngleAxisToRotationMatrix(cam6.val, rotationMat);
@@ -222,21 +672,141 @@ void Reconstruction::adjustBundle(CameraData& cameraData, PointCloud& pointCloud
         cam(0, 3) = cam6(3); 
         cam(1, 3) = cam6(4); 
         cam(2, 3) = cam6(5);
+
+        // camera block is in sync with new pose
+        m_baPoses[it] = cam;
+        m_baIsPoseSynced[it] = true;
     }
 
+    // cameras and points added during optimization follow the correction of the last optimized camera
+    const cv::Matx34d& optLastPose = *std::next(cameraData.extrinsics.begin(), snapshot.numCameras - 1);
+
+    if (!isEmptyPose(lastPose) && (cameraData.extrinsics.size() > snapshot.numCameras || pointCloud.cloud3D.size() > snapshot.numCloudPts)) {
+        const cv::Matx44d _lastT = toHomogeneousMat(lastPose), _optLastT = toHomogeneousMat(optLastPose);
+
+        const cv::Matx44d _camCorrection = _lastT.inv() * _optLastT;
+        const cv::Matx44d _ptCorrection = _optLastT.inv() * _lastT;
+
+        for (; c != cameraData.extrinsics.end(); ++c) {
+            if (isEmptyPose(*c)) { continue; }
+
+            if (checkpoint) { checkpoint->saveCamera(c); }
+
+            *c = (toHomogeneousMat(*c) * _camCorrection).get_minor<3, 4>(0, 0);
+        }
+
+        for (size_t pIdx = snapshot.numCloudPts; pIdx < pointCloud.cloud3D.size(); ++pIdx) {
+            if (checkpoint) { checkpoint->saveCloudPoint(pointCloud, pIdx); }
+
+            const cv::Vec3d& p3d = pointCloud.cloud3D[pIdx];
+
+            const cv::Vec4d _p3d = _ptCorrection * cv::Vec4d(p3d[0], p3d[1], p3d[2], 1.0);
+
+            pointCloud.cloud3D[pIdx] = cv::Vec3d(_p3d[0], _p3d[1], _p3d[2]);
+        }
+
+        if (checkpoint) { checkpoint->saveActualPose(cameraData); }
+
+        decomposeExtrinsicMat(cameraData.extrinsics.back(), cameraData.actualR, cameraData.actualT);
+    }
 
     m_numOptimizations++;
+}
+
+void Reconstruction::adjustBundle(CameraData& cameraData, PointCloud& pointCloud, const uint windowSize) {
+    // problem is owned by running background bundle adjustment
+    if (isBundleAdjusting()) { return; }
+
+    std::cout << (windowSize != 0 && windowSize < cameraData.extrinsics.size() ? "Local bundle adjustment..." : "Bundle adjustment...") << "\n" << std::flush;
+
+    // optimized blocks are written to map only on success
+    BundleSnapshot snapshot;
+
+    if (!prepareBundle(cameraData, pointCloud, windowSize, snapshot) || !solveBundle(snapshot)) { return; }
+
+    applyBundle(snapshot, cameraData, pointCloud);
 
     std::cout << "[DONE]\n";
 }
 
+bool Reconstruction::adjustBundleAsync(CameraData& cameraData, PointCloud& pointCloud, const uint windowSize) {
+    if (isBundleAdjusting()) { return false; }
+
+    std::cout << (windowSize != 0 && windowSize < cameraData.extrinsics.size() ? "Local bundle adjustment in background..." : "Bundle adjustment in background...") << "\n" << std::flush;
+
+    if (!prepareBundle(cameraData, pointCloud, windowSize, m_baSnapshot)) { return false; }
+
+    // worker reads and writes only the problem blocks until merge
+    m_baFuture = std::async(std::launch::async, [this]() { return solveBundle(m_baSnapshot); });
+
+    return true;
+}
+
+bool Reconstruction::mergeBundle(CameraData& cameraData, PointCloud& pointCloud, const bool waitForResult) {
+    if (!isBundleAdjusting()) { return false; }
+
+    if (!waitForResult && m_baFuture.wait_for(std::chrono::seconds(0)) != std::future_status::ready) { return false; }
+
+    if (!m_baFuture.get()) { return false; }
+
+    std::cout << "Merging bundle adjustment..." << std::flush;
+
+    // observations registered during optimization were not part of the problem
+    size_t prevBehind, currBehind;
+
+    const double prevRMSE = mapReprojectionRMSE(m_baSnapshot, cameraData, pointCloud, prevBehind);
+
+    MapCheckpoint checkpoint;
+
+    applyBundle(m_baSnapshot, cameraData, pointCloud, &checkpoint);
+
+    const double currRMSE = mapReprojectionRMSE(m_baSnapshot, cameraData, pointCloud, currBehind);
+
+    // NaN never compares greater -> broken merge is rejected explicitly
+    if (!std::isfinite(currRMSE) || currRMSE > prevRMSE || currBehind > prevBehind) {
+        checkpoint.rollback(cameraData, pointCloud);
+
+        std::cout << "[FAILED] RMSE " << prevRMSE << " -> " << currRMSE << "; Behind camera: " << prevBehind << " -> " << currBehind << " -> rolling back!" << "\n";
+
+        return false;
+    }
+
+    std::cout << "[DONE] RMSE " << prevRMSE << " -> " << currRMSE << "\n";
+
+    return true;
+}
+
+void CloudObservations::updatePointIndex() const {
+    if (m_numIndexedRows == m_rows.size() && m_pointOffsets.size() == m_numPoints + 1) { return; }
+
+    // counting sort of rows by cloud point -> rows of each point stay in registration order
+    m_pointOffsets.assign(m_numPoints + 1, 0);
+
+    for (const auto& obs : m_rows)
+        m_pointOffsets[obs.cloudIdx + 1]++;
+
+    for (size_t i = 0; i < m_numPoints; ++i)
+        m_pointOffsets[i + 1] += m_pointOffsets[i];
+
+    m_pointRows.resize(m_rows.size());
+
+    std::vector<size_t> _fill(m_pointOffsets.begin(), m_pointOffsets.end() - 1);
+
+    for (size_t row = 0; row < m_rows.size(); ++row)
+        m_pointRows[_fill[m_rows[row].cloudIdx]++] = row;
+
+    m_numIndexedRows = m_rows.size();
+}
+
 void PointCloud::prepareFilterCloud(pcl::PointCloud<pcl::PointXYZ>::Ptr& cloud, std::vector<size_t>& userCloudIdx) {
-    for (auto [p3d, p3dEnd, pIdx] = std::tuple{cloud3D.cbegin(), cloud3D.cend(), 0}; p3d != p3dEnd; ++p3d, ++pIdx) {
+    for (size_t pIdx = 0; pIdx < cloud3D.size(); ++pIdx) {
         if (cloudMask[pIdx]) {
+            const cv::Vec3d& p3d = cloud3D[pIdx];
+
             cloud->push_back(pcl::PointXYZ(
-                p3d->val[0],
-                p3d->val[1],
-                p3d->val[2]
+                p3d.val[0],
+                p3d.val[1],
+                p3d.val[2]
                 )
             );
 
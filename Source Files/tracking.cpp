@@ -45,43 +45,85 @@ void RecoveryPose::drawRecoveredPose(cv::Mat inputImg, cv::Mat& outputImg, const
     }
 }
 
-bool Tracking::addTrackView(ViewData* view, TrackView trackView, const std::vector<bool>& mask, const std::vector<cv::Point2f>& points2D, const std::vector<cv::Vec3d> points3D, const std::vector<cv::Vec3b>& pointsRGB, const std::vector<cv::KeyPoint>& keyPoints, const cv::Mat& descriptor, const std::vector<int>& ptsToKeyIdx) {
+cv::Mat DescriptorArena::append(const cv::Mat& descriptor, const std::vector<int>& rowIdxs) {
+    const int numRows = rowIdxs.size();
+
+    if (numRows == 0 || descriptor.empty()) { return cv::Mat(); }
+
+    //  start new chunk if rows do not fit -> view range stays contiguous
+    if (m_chunks.empty() || m_chunks.back().type() != descriptor.type() || m_chunks.back().cols != descriptor.cols || m_numChunkRows + numRows > m_chunks.back().rows) {
+        m_chunks.push_back(cv::Mat(std::max(CHUNK_ROWS, numRows), descriptor.cols, descriptor.type()));
+
+        m_numChunkRows = 0;
+    }
+
+    cv::Mat& _chunk = m_chunks.back();
+
+    const size_t rowBytes = descriptor.cols * descriptor.elemSize();
+
+    for (int i = 0; i < numRows; ++i)
+        std::memcpy(_chunk.ptr(m_numChunkRows + i), descriptor.ptr(rowIdxs[i]), rowBytes);
+
+    const cv::Mat _rows = _chunk.rowRange(m_numChunkRows, m_numChunkRows + numRows);
+
+    m_numChunkRows += numRows;
+
+    return _rows;
+}
+
+bool Tracking::addTrackView(TrackView&& trackView, const std::vector<bool>& mask, const std::vector<cv::Point2f>& points2D, const std::vector<cv::Vec3d>& points3D, const std::vector<cv::Vec3b>& pointsRGB, const std::vector<cv::KeyPoint>& keyPoints, const cv::Mat& descriptor, const std::vector<int>& ptsToKeyIdx) {
     size_t newPtsAdded = 0, newPtsRegistered = 0;
 
+    //  tracks are collected first and stored in bulk
+    std::vector<int> _descIdxs; _descIdxs.reserve(points3D.size());
+
+    trackView.keyPoints.reserve(trackView.keyPoints.size() + points3D.size());
+    trackView.cloudIdxs.reserve(trackView.cloudIdxs.size() + points3D.size());
 
     for (uint idx = 0; idx < points3D.size(); ++idx) {
         //  mapping from triangulated point (alligned) to corresponding keypoint/descriptor (not alligned)
-        const cv::KeyPoint _keypoint = ptsToKeyIdx.empty() ? keyPoints[idx] : keyPoints[ptsToKeyIdx[idx]];
-        const cv::Mat _descriptor = ptsToKeyIdx.empty() ? descriptor.row(idx) : descriptor.row(ptsToKeyIdx[idx]);
+        const int _keyIdx = ptsToKeyIdx.empty() ? idx : ptsToKeyIdx[idx];
+        const cv::KeyPoint& _keypoint = keyPoints[_keyIdx];
 
         //  Add only good reprojected points, points in front of camera, points not far away from camera
         if (mask[idx]) {
+            size_t cloudIdx;
+
             //  Check if point is new -> add to cloud otherwise add to seen points
-            if (trackView.ptToCloudMap.find(std::pair{_keypoint.pt.x, _keypoint.pt.y}) == trackView.ptToCloudMap.end()) {
-                trackView.addTrack(_keypoint, _descriptor, m_pointCloud->getNumCloudPoints());
+            if (const size_t* _mappedIdx = trackView.ptToCloudMap.find(_keyIdx); _mappedIdx == NULL) {
+                cloudIdx = m_pointCloud->getNumCloudPoints();
 
                 m_pointCloud->addCloudPoint(_keypoint.pt, points3D[idx], pointsRGB[idx]);
 
                 newPtsAdded++;
             } else {
-                size_t cloudIdx = trackView.ptToCloudMap[std::pair{_keypoint.pt.x, _keypoint.pt.y}];
+                cloudIdx = *_mappedIdx;
                 
                 m_pointCloud->registerCloudView(cloudIdx, _keypoint.pt);
 
-                trackView.addTrack(_keypoint, _descriptor, cloudIdx);
-
                 newPtsRegistered++;
             }
+
+            trackView.keyPoints.push_back(_keypoint);
+            trackView.cloudIdxs.push_back(cloudIdx);
+
+            _descIdxs.push_back(_keyIdx);
         }  
     }
 
+    trackView.descriptor = m_descArena.append(descriptor, _descIdxs);
+
     std::cout << "New points were added to cloud: " << newPtsAdded << "; Total points: " << m_pointCloud->getNumActiveCloudPoints() << "\n";
 
     //if (newPtsAdded == 0 && newPtsRegistered == 0) { return false; }
 
-    trackView.setView(view);
+    // index grows by registered tracks only
+    m_descIndex.add(trackView.descriptor, trackView.cloudIdxs);
+
+    //  position map is used only for registration of this view
+    trackView.ptToCloudMap.release();
 
-    trackViews.push_back(trackView);
+    trackViews.push_back(std::move(trackView));
 
     m_pointCloud->cloudSelectedLayer++;
 
@@ -119,8 +161,6 @@ bool Tracking::findRecoveredCameraPose(DescriptorMatcher matcher, int minMatches
     std::vector<cv::Point2f> _posePoints2D;
     std::vector<cv::Vec3d> _posePoints3D;
 
-    cv::Mat _R, _t, _inliers;
-    
     std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
 
     uint trackIter = 0;
@@ -137,56 +177,289 @@ bool Tracking::findRecoveredCameraPose(DescriptorMatcher matcher, int minMatches
 
         //std::cout << "Recover pose matches: " << _matches.size() << "\n";
 
-        /*if (!t->viewPtr->imColor.empty() && !featView.viewPtr->imColor.empty()) {
-            cv::Mat _imOutMatch; cv::drawMatches(t->viewPtr->imColor, t->keyPoints, featView.viewPtr->imColor, featView.keyPts, _matches, _imOutMatch);
-            cv::imshow("Matches", _imOutMatch); cv::waitKey(1);
-        }*/
+        //  each keypoint is mapped at most once
+        outTrackView.ptToCloudMap.reserve(featView.keyPts.size());
 
         for (const auto& m : _matches) {
             //  2D point from new view
             cv::Point2f _point2D = (cv::Point2f)featView.keyPts[m.trainIdx].pt;
 
-            //  prevent duplicities
-            if (outTrackView.ptToCloudMap.find(std::pair{_point2D.x, _point2D.y}) == outTrackView.ptToCloudMap.end()) {
-                if (pointCloud.cloudMask[m.queryIdx]) {
-                     // mapper from vector to list item
-                    cv::Vec3d* cloudMapper = pointCloud.cloudMapper[t->cloudIdxs[m.queryIdx]];
+            //  prevent duplicities -> insert fails for already mapped keypoint
+            if (pointCloud.cloudMask[t->cloudIdxs[m.queryIdx]] && outTrackView.ptToCloudMap.insert(m.trainIdx, t->cloudIdxs[m.queryIdx])) {
+                //  3D point from old view
+                const cv::Vec3d& _point3D = pointCloud.cloud3D[t->cloudIdxs[m.queryIdx]];
+            
+                _posePoints2D.push_back(_point2D);
+                _posePoints3D.push_back(_point3D);
+            }
+        }
+    }
 
-                    //  3D point from old view
-                    cv::Vec3d _point3D = (cv::Vec3d)*cloudMapper;
-                
-                    _posePoints2D.push_back(_point2D);
-                    _posePoints3D.push_back(_point3D);
-                    
-                    outTrackView.ptToCloudMap[std::pair{_point2D.x, _point2D.y}] = t->cloudIdxs[m.queryIdx];
-                }  
+    const bool isPoseFound = solveCameraPose(camera, recPose, _posePoints2D, _posePoints3D);
+
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    std::cout << "\n----------------------------------------------------------\n\n";
+    std::cout << "Total computing time: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.0 << " seconds!\n";
+
+    return isPoseFound;
+ }
+
+bool Tracking::findIndexedCameraPose(const float ratioThreshold, CameraParameters camera, FeatureView& featView, RecoveryPose& recPose, TrackView& outTrackView, PointCloud& pointCloud) {
+    if (m_descIndex.empty() || featView.keyPts.empty()) { return false; }
+
+    std::cout << "Index matching..." << std::flush;
+
+    std::vector<cv::Point2f> _posePoints2D;
+    std::vector<cv::Vec3d> _posePoints3D;
+
+    std::vector<cv::DMatch> _matches;
+
+    //  one query against descriptors of all track views
+    m_descIndex.match(featView.descriptor, ratioThreshold, _matches);
+
+    outTrackView.ptToCloudMap.reserve(featView.keyPts.size());
+
+    for (const auto& m : _matches) {
+        const size_t cloudIdx = m_descIndex.getCloudIdx(m.trainIdx);
+
+        if (!pointCloud.cloudMask[cloudIdx]) { continue; }
+
+        //  2D point from new view
+        const cv::Point2f _point2D = featView.keyPts[m.queryIdx].pt;
+
+        //  prevent duplicities
+        if (outTrackView.ptToCloudMap.insert(m.queryIdx, cloudIdx)) {
+            _posePoints2D.push_back(_point2D);
+            _posePoints3D.push_back(pointCloud.cloud3D[cloudIdx]);
+        }
+    }
+
+    std::cout << "Index matches: " << _posePoints2D.size() << "\n";
+
+    if (solveCameraPose(camera, recPose, _posePoints2D, _posePoints3D)) { return true; }
+
+    //  do not leave failed correspondences to fallback matching
+    outTrackView.ptToCloudMap.clear();
+
+    return false;
+}
+
+bool Tracking::findGuidedCameraPose(const float ratioThreshold, const float searchRadius, const uint numIter, const int maxTrackIter, CameraParameters camera, const cv::Matx34d& predictedPose, FeatureView& featView, RecoveryPose& recPose, TrackView& outTrackView, PointCloud& pointCloud) {
+    if (trackViews.empty() || featView.keyPts.empty() || searchRadius <= 0) { return false; }
+
+    std::cout << "Guided matching..." << std::flush;
+
+    const bool isBinary = featView.descriptor.type() == CV_8U;
+
+    cv::Mat _currDesc;
+    if (isBinary)
+        HammingKnnMatcher::padRows(featView.descriptor, _currDesc);
+    else
+        featView.descriptor.convertTo(_currDesc, CV_32F);
+
+    //  bucket keypoints to grid of search radius cells -> 3x3 cells cover the search window
+    const float cellSize = searchRadius;
+
+    cv::Point2f _maxPt;
+    for (const auto& k : featView.keyPts) {
+        _maxPt.x = std::max(_maxPt.x, k.pt.x);
+        _maxPt.y = std::max(_maxPt.y, k.pt.y);
+    }
+
+    const int gridCols = (int)(_maxPt.x / cellSize) + 1, gridRows = (int)(_maxPt.y / cellSize) + 1;
+
+    //  projections outside of keypoints area enlarged by search radius have no candidates
+    const cv::Rect2f _searchArea(-searchRadius, -searchRadius, gridCols * cellSize + 2 * searchRadius, gridRows * cellSize + 2 * searchRadius);
+
+    std::vector<std::vector<int>> _grid(gridCols * gridRows);
+
+    for (size_t i = 0; i < featView.keyPts.size(); ++i) {
+        const cv::Point2f& _pt = featView.keyPts[i].pt;
+
+        if (_pt.x >= 0 && _pt.y >= 0)
+            _grid[(int)(_pt.y / cellSize) * gridCols + (int)(_pt.x / cellSize)].push_back(i);
+    }
+
+    const cv::Matx34d _projMat = camera.K33d * predictedPose;
+    const float _sqRadius = searchRadius * searchRadius;
+
+    //  best cloud point for each keypoint
+    std::vector<float> _keyBestDist(featView.keyPts.size(), FLT_MAX);
+    std::vector<size_t> _keyCloudIdx(featView.keyPts.size(), SIZE_MAX);
+
+    std::unordered_set<size_t> _usedCloudIdxs;
+
+    //  keypoints in search window of single projection
+    std::vector<int> _windowKeys, _windowDists;
+    std::vector<const uchar*> _windowRows;
+
+    int trackIter = 0;
+    for (auto t = trackViews.rbegin(); t != trackViews.rend() && trackIter < maxTrackIter; ++t, trackIter++) {
+        if (t->cloudIdxs.empty() || t->descriptor.type() != featView.descriptor.type()) { continue; }
+
+        cv::Mat _trackDesc;
+        if (isBinary)
+            HammingKnnMatcher::padRows(t->descriptor, _trackDesc);
+        else
+            t->descriptor.convertTo(_trackDesc, CV_32F);
+
+        for (size_t i = 0; i < t->cloudIdxs.size(); ++i) {
+            const size_t cloudIdx = t->cloudIdxs[i];
+
+            //  the most recent observation of cloud point is used
+            if (!pointCloud.cloudMask[cloudIdx] || !_usedCloudIdxs.insert(cloudIdx).second) { continue; }
+
+            const cv::Vec3d& _point3D = pointCloud.cloud3D[cloudIdx];
+
+            const cv::Matx31d _proj = _projMat * cv::Matx41d(_point3D[0], _point3D[1], _point3D[2], 1.0);
+
+            //  point behind predicted camera
+            if (_proj(2) <= 0) { continue; }
+
+            const cv::Point2f _projPt(_proj(0) / _proj(2), _proj(1) / _proj(2));
+
+            //  reject before cell index conversion -> far projections overflow int
+            if (!_searchArea.contains(_projPt)) { continue; }
+
+            const int cellX = (int)std::floor(_projPt.x / cellSize), cellY = (int)std::floor(_projPt.y / cellSize);
+
+            _windowKeys.clear(); _windowRows.clear();
+
+            for (int y = std::max(cellY - 1, 0); y <= std::min(cellY + 1, gridRows - 1); ++y) {
+                for (int x = std::max(cellX - 1, 0); x <= std::min(cellX + 1, gridCols - 1); ++x) {
+                    for (const auto& k : _grid[y * gridCols + x]) {
+                        const cv::Point2f _diff = featView.keyPts[k].pt - _projPt;
+
+                        if (_diff.dot(_diff) > _sqRadius) { continue; }
+
+                        _windowKeys.push_back(k);
+                        _windowRows.push_back(_currDesc.ptr<uchar>(k));
+                    }
+                }
+            }
+
+            //  binary distances of the whole search window by one kernel call
+            _windowDists.resize(_windowKeys.size());
+            if (isBinary)
+                HammingKnnMatcher::distances(_trackDesc.ptr<uchar>(i), _windowRows.data(), (int)_windowRows.size(), _currDesc.cols, _windowDists.data());
+
+            float bestDist = FLT_MAX, secondDist = FLT_MAX; int bestKey = -1;
+
+            for (size_t w = 0; w < _windowKeys.size(); ++w) {
+                const int k = _windowKeys[w];
+
+                const float dist = isBinary ? 
+                    (float)_windowDists[w] : 
+                    std::sqrt(cv::normL2Sqr<float, float>(_trackDesc.ptr<float>(i), _currDesc.ptr<float>(k), _currDesc.cols));
+
+                if (dist < bestDist) {
+                    secondDist = bestDist; bestDist = dist; bestKey = k;
+                } else if (dist < secondDist)
+                    secondDist = dist;
+            }
+
+            //  single keypoint in window is accepted, prior from predicted pose is strong enough
+            if (bestKey < 0 || (secondDist != FLT_MAX && bestDist >= ratioThreshold * secondDist)) { continue; }
+
+            if (bestDist < _keyBestDist[bestKey]) {
+                _keyBestDist[bestKey] = bestDist;
+                _keyCloudIdx[bestKey] = cloudIdx;
             }
         }
     }
 
+    std::vector<cv::Point2f> _posePoints2D;
+    std::vector<cv::Vec3d> _posePoints3D;
+
+    outTrackView.ptToCloudMap.reserve(featView.keyPts.size());
+
+    for (size_t k = 0; k < featView.keyPts.size(); ++k) {
+        if (_keyCloudIdx[k] == SIZE_MAX) { continue; }
+
+        const cv::Point2f _point2D = featView.keyPts[k].pt;
+
+        //  prevent duplicities
+        if (outTrackView.ptToCloudMap.insert(k, _keyCloudIdx[k])) {
+            _posePoints2D.push_back(_point2D);
+            _posePoints3D.push_back(pointCloud.cloud3D[_keyCloudIdx[k]]);
+        }
+    }
+
+    std::cout << "Guided matches: " << _posePoints2D.size() << "\n";
+
+    if (solveCameraPose(camera, recPose, _posePoints2D, _posePoints3D, &predictedPose, numIter)) { return true; }
+
+    //  do not leave failed correspondences to fallback matching
+    outTrackView.ptToCloudMap.clear();
+
+    return false;
+}
+
+double Tracking::inlierReprojectionError(CameraParameters camera, const std::vector<cv::Point2f>& points2D, const std::vector<cv::Vec3d>& points3D, const cv::Mat& R, const cv::Mat& t) {
+    std::vector<cv::Point2f> _projPoints; cv::projectPoints(points3D, R, t, camera.K, cv::Mat(), _projPoints);
+
+    double _sqError = 0.0;
+
+    for (size_t i = 0; i < _projPoints.size(); ++i) {
+        const cv::Point2f _diff = _projPoints[i] - points2D[i];
+
+        _sqError += _diff.dot(_diff);
+    }
+
+    //  non finite error never wins the comparison
+    return std::isfinite(_sqError) ? _sqError : std::numeric_limits<double>::max();
+}
+
+bool Tracking::solveCameraPose(CameraParameters camera, RecoveryPose& recPose, const std::vector<cv::Point2f>& posePoints2D, const std::vector<cv::Vec3d>& posePoints3D, const cv::Matx34d* poseGuess, const uint numIter) {
     //  Min point filter
-    if (_posePoints2D.size() < 7 || _posePoints3D.size() < 7) { return false; }
+    if (posePoints2D.size() < 7 || posePoints3D.size() < 7) { return false; }
 
     std::cout << "Recovering pose..." << std::flush;
 
+    cv::Mat _R, _t, _inliers;
+
     //  Use solvePnPRansac instead of solvePnP -> RANSAC is more robustness
-    if (!cv::solvePnPRansac(_posePoints3D, _posePoints2D, camera.K, cv::Mat(), _R, _t, recPose.useExtrinsicGuess, recPose.numIter, recPose.threshold, recPose.prob, _inliers, recPose.poseEstMethod)) { return false; }
-    //if (!cv::solvePnP(_posePoints3D, _posePoints2D, camera.K, cv::Mat(), _R, _t, recPose.useExtrinsicGuess, recPose.poseEstMethod)) { return false; }
+    //  Minimal RANSAC solvers (P3P, AP3P, EPnP) ignore extrinsic guess -> guess is only compared after refinement
+    if (!cv::solvePnPRansac(posePoints3D, posePoints2D, camera.K, cv::Mat(), _R, _t, recPose.useExtrinsicGuess, numIter > 0 ? numIter : recPose.numIter, recPose.threshold, recPose.prob, _inliers, recPose.poseEstMethod)) { return false; }
+    //if (!cv::solvePnP(posePoints3D, posePoints2D, camera.K, cv::Mat(), _R, _t, recPose.useExtrinsicGuess, recPose.poseEstMethod)) { return false; }
 
     std::cout << "Recover pose inliers: " << _inliers.rows << "\n";
 
-    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-
-    std::cout << "\n----------------------------------------------------------\n\n";
-    std::cout << "Total computing time: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.0 << " seconds!\n";
-
     //  Min PnP inliers filter
     if (_inliers.rows < recPose.minInliers) { return false; }
 
+    //  Refine RANSAC pose on its inliers
+    //  Refined prediction is kept only when it reprojects the same inliers better -> bad prediction is never accepted
+    if (poseGuess != NULL) {
+        std::vector<cv::Point2f> _inlierPoints2D; _inlierPoints2D.reserve(_inliers.rows);
+        std::vector<cv::Vec3d> _inlierPoints3D; _inlierPoints3D.reserve(_inliers.rows);
+
+        for (int i = 0; i < _inliers.rows; ++i) {
+            const int idx = _inliers.at<int>(i);
+
+            _inlierPoints2D.push_back(posePoints2D[idx]);
+            _inlierPoints3D.push_back(posePoints3D[idx]);
+        }
+
+        cv::solvePnPRefineLM(_inlierPoints3D, _inlierPoints2D, camera.K, cv::Mat(), _R, _t);
+
+        cv::Matx33d _guessR; cv::Matx31d _guessT; decomposeExtrinsicMat(*poseGuess, _guessR, _guessT);
+
+        cv::Mat _guessRvec, _guessTvec = cv::Mat(_guessT).clone(); cv::Rodrigues(_guessR, _guessRvec);
+
+        cv::solvePnPRefineLM(_inlierPoints3D, _inlierPoints2D, camera.K, cv::Mat(), _guessRvec, _guessTvec);
+
+        const double _ransacError = inlierReprojectionError(camera, _inlierPoints2D, _inlierPoints3D, _R, _t);
+        const double _guessError = inlierReprojectionError(camera, _inlierPoints2D, _inlierPoints3D, _guessRvec, _guessTvec);
+
+        if (_guessError < _ransacError) { _R = _guessRvec; _t = _guessTvec; }
+    }
+
     //  Rotation matrix to rotation vector
     cv::Rodrigues(_R, recPose.R); recPose.t = _t;
 
     std::cout << "[DONE]\n";
 
     return true;
- }
\ No newline at end of file
+}
\ No newline at end of file
@@ -71,17 +71,17 @@ void UserInput::recoverPoints(cv::Mat& imOutUsr) {
     }
 }
 
+void UserInput::keepCloudPoints() {
+    for (const auto& idx : usrCloudPtsIdx)
+        m_pointCloud->cloudMask[idx] = true;
+}
+
 void UserInput::recoverPoints(cv::Mat& imOutUsr, cv::Mat cameraK, cv::Mat R, cv::Mat t) {
     if (!m_pointCloud->cloud3D.empty() && !usrCloudPtsIdx.empty()) {
         std::vector<cv::Vec3d> usrPts3D;
 
-        for (const auto& idx : usrCloudPtsIdx) {
-            cv::Vec3d* cloudMapper = m_pointCloud->cloudMapper[idx];
-
-            usrPts3D.push_back(*cloudMapper);
-
-            m_pointCloud->cloudMask[idx] = true;
-        }
+        for (const auto& idx : usrCloudPtsIdx)
+            usrPts3D.push_back(m_pointCloud->cloud3D[idx]);
 
         cv::Mat recoveredPts; cv::projectPoints(usrPts3D, R, t, cameraK, cv::Mat(), recoveredPts);
 
@@ -94,34 +94,35 @@ void UserInput::recoverPoints(cv::Mat& imOutUsr, cv::Mat cameraK, cv::Mat R, cv:
     } 
 }
 
-void UserInput::attachPointsToMove(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, std::vector<uchar>& statusMask, bool clickPts, bool usrPts) {
-    if (!prevPts.empty()) {
+void UserInput::attachPointsToMove(FlowTracks& tracks, bool clickPts, bool usrPts) {
+    if (!tracks.empty()) {
         if (clickPts)
-            prevPts.insert(prevPts.end(), doneClickedPts.begin(), doneClickedPts.end());
+            tracks.addPoints(doneClickedPts, m_clickPtsIdOffset);
         if (usrPts)
-            prevPts.insert(prevPts.end(), doneUsrPts.begin(), doneUsrPts.end());
+            tracks.addPoints(doneUsrPts, m_usrPtsIdOffset);
     }
 }
 
-void UserInput::detachPointsFromMove(std::vector<cv::Point2f>& prevPts, std::vector<cv::Point2f>& currPts, std::vector<uchar>& statusMask, bool clickPts, bool usrPts) {
-    size_t _ptsSize = 0;
+void UserInput::detachPointsFromMove(FlowTracks& tracks, bool clickPts, bool usrPts) {
+    if (tracks.currPts.size() != tracks.size()) { return; }
 
-    if (!currPts.empty()) {
-        if (usrPts) {
-            moveUsrPts.insert(moveUsrPts.end(), currPts.end() - doneUsrPts.size(), currPts.end());
+    const size_t numTracks = tracks.size();
 
-            _ptsSize += doneUsrPts.size();
-        }
-        if (clickPts) {
-            moveClickedPts.insert(moveClickedPts.end(), currPts.end() - doneClickedPts.size(), currPts.end());
+    std::vector<uchar>& _isCorner = tracks.getKeepMask();
 
-            _ptsSize += doneClickedPts.size();
-        }
-    }
+    // tracks keep attach order -> moved points are aligned with done points
+    for (size_t i = 0; i < numTracks; ++i) {
+        const size_t id = tracks.ids[i];
 
-    for (int i = 0; i < _ptsSize; ++i) {
-        prevPts.pop_back();
-        currPts.pop_back();
-        statusMask.pop_back();
+        if (id >= m_usrPtsIdOffset) {
+            if (usrPts)
+                moveUsrPts.push_back(tracks.currPts[i]);
+        } else if (id >= m_clickPtsIdOffset) {
+            if (clickPts)
+                moveClickedPts.push_back(tracks.currPts[i]);
+        } else
+            _isCorner[i] = true;
     }
+
+    tracks.compact(_isCorner);
 }
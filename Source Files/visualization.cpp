@@ -32,20 +32,25 @@ boost::shared_ptr<pcl::visualization::PCLVisualizer> VisPCL::getNewViewer(const
     return (viewer);
 }
 
-void VisPCL::updatePointCloud(const std::list<cv::Vec3d>& points3D, const std::list<cv::Vec3b>& pointsRGB, std::vector<bool>& pointsMask) {
+void VisPCL::updatePointCloud(const ChunkedArray<cv::Vec3d>& points3D, const ChunkedArray<cv::Vec3b>& pointsRGB, std::vector<bool>& pointsMask) {
     if (isViewerInitialized()) {
         pcl::PointCloud<pcl::PointXYZRGB>::Ptr pointCloud(new pcl::PointCloud<pcl::PointXYZRGB>);
 
-        for (auto [p3d, p3dEnd, pClr, pClrEnd, pIdx] = std::tuple{points3D.cbegin(), points3D.cend(), pointsRGB.cbegin(), pointsRGB.cend(), 0}; p3d != p3dEnd && pClr != pClrEnd; ++p3d, ++pClr, ++pIdx) {
+        const size_t numPts = std::min(points3D.size(), pointsRGB.size());
+
+        for (size_t pIdx = 0; pIdx < numPts; ++pIdx) {
             if (pointsMask[pIdx]) {
+                const cv::Vec3d& p3d = points3D[pIdx];
+                const cv::Vec3b& pClr = pointsRGB[pIdx];
+
                 pcl::PointXYZRGB rgbPoint;
-                rgbPoint.x = p3d->val[0];
-                rgbPoint.y = p3d->val[1];
-                rgbPoint.z = p3d->val[2];
+                rgbPoint.x = p3d.val[0];
+                rgbPoint.y = p3d.val[1];
+                rgbPoint.z = p3d.val[2];
 
-                rgbPoint.r = pClr->val[2];
-                rgbPoint.g = pClr->val[1];
-                rgbPoint.b = pClr->val[0];
+                rgbPoint.r = pClr.val[2];
+                rgbPoint.g = pClr.val[1];
+                rgbPoint.b = pClr.val[0];
 
                 pointCloud->push_back(rgbPoint);
             }
@@ -154,9 +159,9 @@ bool VisVTK::isViewerInitialized() const {
     return true;
 }
 
-void VisVTK::updatePointCloud(const std::list<cv::Vec3d>& points3D, const std::list<cv::Vec3b>& pointsRGB, std::vector<bool>& pointsMask) {
-    const std::vector<cv::Vec3d> _points3D(points3D.begin(), points3D.end());
-    const std::vector<cv::Vec3b> _pointsRGB(pointsRGB.begin(), pointsRGB.end());
+void VisVTK::updatePointCloud(const ChunkedArray<cv::Vec3d>& points3D, const ChunkedArray<cv::Vec3b>& pointsRGB, std::vector<bool>& pointsMask) {
+    std::vector<cv::Vec3d> _points3D; points3D.copyTo(_points3D);
+    std::vector<cv::Vec3b> _pointsRGB; pointsRGB.copyTo(_pointsRGB);
 
     const cv::viz::WCloud _pCloud(_points3D, _pointsRGB);
     
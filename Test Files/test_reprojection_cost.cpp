@@ -0,0 +1,91 @@
+#include "reconstruction.h"
+
+/**
+ * Compare SnavelyReprojectionCost analytic jacobians with AutoDiff SnavelyReprojectionError
+ *
+ * Residuals and jacobians of intrinsics, extrinsics and point blocks are evaluated on random cameras and points
+ * A quarter of poses has exact zero rotation and a quarter has rotation below ceres small angle threshold
+ * -> small angle branches of both rotation models are covered, the rest of poses has general rotation
+ */
+
+static bool isClose(const double a, const double b, const double tolerance) {
+    return std::abs(a - b) <= tolerance * std::max(1.0, std::max(std::abs(a), std::abs(b)));
+}
+
+static bool compareValues(const char* name, const double* lValues, const double* rValues, const int numValues, const double tolerance, const int trial) {
+    for (int i = 0; i < numValues; ++i) {
+        if (!isClose(lValues[i], rValues[i], tolerance)) {
+            std::cout << "Trial " << trial << ": " << name << "[" << i << "] analytic " << lValues[i] << " != autodiff " << rValues[i] << "\n";
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const int numTrials = argc > 1 ? std::atoi(argv[1]) : 10000;
+    const double tolerance = 1e-7;
+
+    cv::RNG rng(0x5f3759df);
+
+    int numFailed = 0;
+
+    for (int trial = 0; trial < numTrials; ++trial) {
+        double intrinsics[4] = { rng.uniform(200.0, 2000.0), rng.uniform(200.0, 2000.0), rng.uniform(0.0, 1000.0), rng.uniform(0.0, 1000.0) };
+
+        // exact zero, below ceres small angle threshold (theta^2 < DBL_EPSILON) or general rotation up to pi
+        // AutoDiff reference is first order below threshold and divides by theta just above it
+        // -> small angles are kept where the reference error is far below tolerance
+        double angle;
+        switch (trial % 4) {
+            case 0: angle = 0.0; break;
+            case 1: angle = std::pow(10.0, rng.uniform(-16.0, -13.0)); break;
+            default: angle = rng.uniform(0.0, CV_PI); break;
+        }
+
+        cv::Vec3d axis(rng.gaussian(1.0), rng.gaussian(1.0), rng.gaussian(1.0)); axis /= cv::norm(axis);
+
+        double extrinsics[6] = { angle * axis[0], angle * axis[1], angle * axis[2], rng.uniform(-10.0, 10.0), rng.uniform(-10.0, 10.0), rng.uniform(-10.0, 10.0) };
+
+        // point is generated in front of camera and moved to world coordinates -> X = R^T (Xc - t)
+        const double pointCam[3] = { rng.uniform(-20.0, 20.0) - extrinsics[3], rng.uniform(-20.0, 20.0) - extrinsics[4], rng.uniform(1.0, 50.0) - extrinsics[5] };
+        const double inverseRotation[3] = { -extrinsics[0], -extrinsics[1], -extrinsics[2] };
+
+        double point[3]; ceres::AngleAxisRotatePoint(inverseRotation, pointCam, point);
+
+        const double observedX = rng.uniform(0.0, 1920.0), observedY = rng.uniform(0.0, 1080.0);
+
+        SnavelyReprojectionCost analyticCost(observedX, observedY);
+        std::unique_ptr<ceres::CostFunction> autoDiffCost(SnavelyReprojectionError::Create(observedX, observedY));
+
+        const double* parameters[3] = { intrinsics, extrinsics, point };
+
+        double analyticResiduals[2], analyticIntrinsics[2 * 4], analyticExtrinsics[2 * 6], analyticPoint[2 * 3];
+        double autoDiffResiduals[2], autoDiffIntrinsics[2 * 4], autoDiffExtrinsics[2 * 6], autoDiffPoint[2 * 3];
+
+        double* analyticJacobians[3] = { analyticIntrinsics, analyticExtrinsics, analyticPoint };
+        double* autoDiffJacobians[3] = { autoDiffIntrinsics, autoDiffExtrinsics, autoDiffPoint };
+
+        if (!analyticCost.Evaluate(parameters, analyticResiduals, analyticJacobians) || !autoDiffCost->Evaluate(parameters, autoDiffResiduals, autoDiffJacobians)) {
+            std::cout << "Trial " << trial << ": evaluation failed\n";
+
+            numFailed++;
+
+            continue;
+        }
+
+        const bool isEqual =
+            compareValues("residuals", analyticResiduals, autoDiffResiduals, 2, tolerance, trial) &&
+            compareValues("intrinsics jacobian", analyticIntrinsics, autoDiffIntrinsics, 2 * 4, tolerance, trial) &&
+            compareValues("extrinsics jacobian", analyticExtrinsics, autoDiffExtrinsics, 2 * 6, tolerance, trial) &&
+            compareValues("point jacobian", analyticPoint, autoDiffPoint, 2 * 3, tolerance, trial);
+
+        if (!isEqual) { numFailed++; }
+    }
+
+    std::cout << "Reprojection cost trials: " << numTrials << "; Failed: " << numFailed << "\n";
+
+    return numFailed == 0 ? 0 : 1;
+}